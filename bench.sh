@@ -0,0 +1,133 @@
+#!/bin/sh
+# Copyright 2023 Northern.tech AS
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+
+# Reports how much data write-optimized mode actually submits and how many
+# erase blocks it wears for typical update deltas, and whether discarding the
+# target pays off for full rewrites.
+#
+# Environment variables:
+#   BENCH_SIZE_MB     size of the image (default: 64)
+#   BENCH_ERASE_SIZE  erase block size of the device in bytes (default: 524288)
+#   BENCH_DIR         where to create the image and the target (default: a
+#                     temporary directory)
+#   BENCH_TARGET      device (or file) for the full rewrites with and without
+#                     --discard, ITS CONTENTS ARE DESTROYED (default: a file in
+#                     BENCH_DIR)
+
+MEN_FLASH="./mender-flash"
+if [ $# -ge 1 ]; then
+  MEN_FLASH="$1/mender-flash"
+fi
+
+BLOCK=1048576
+PAGE=4096
+SIZE_MB=${BENCH_SIZE_MB:-64}
+ERASE_SIZE=${BENCH_ERASE_SIZE:-524288}
+
+random_below() {
+  echo $(( $(od -An -N4 -tu4 /dev/urandom) % $1 ))
+}
+
+# scenario functions modify the input image in place
+
+no_change() {
+  :
+}
+
+scattered_pages() {
+  # e.g. a few configuration files and the package database
+  for i in $(seq 16); do
+    dd if=/dev/urandom of="$INPUT" bs=$PAGE count=1 conv=notrunc \
+       seek=$(random_below $((SIZE_MB * BLOCK / PAGE))) >/dev/null 2>&1
+  done
+}
+
+contiguous_8mib() {
+  # e.g. one updated package
+  dd if=/dev/urandom of="$INPUT" bs=$BLOCK count=8 conv=notrunc \
+     seek=$(random_below $((SIZE_MB - 8))) >/dev/null 2>&1
+}
+
+ten_percent_blocks() {
+  # e.g. a library stack upgrade
+  for i in $(seq $((SIZE_MB / 10))); do
+    dd if=/dev/urandom of="$INPUT" bs=$BLOCK count=1 conv=notrunc \
+       seek=$(random_below $SIZE_MB) >/dev/null 2>&1
+  done
+}
+
+stat_value() {
+  sed -n "s/^$1:\s\+\([0-9]\+\)\$/\1/p" "$STATS"
+}
+
+run_scenario() {
+  local scenario="$1"
+
+  cp "$BASE" "$INPUT" && cp "$BASE" "$OUTPUT" && $scenario || return 1
+
+  local start=$(date +%s%N)
+  $MEN_FLASH --erase-size $ERASE_SIZE -i "$INPUT" -o "$OUTPUT" > "$STATS" || return 1
+  local end=$(date +%s%N)
+
+  cmp -s "$INPUT" "$OUTPUT" || { echo "$scenario: input and output differ"; return 1; }
+
+  printf "%-20s %12s %14s %14s %10s %8s\n" "$scenario" \
+         "$(stat_value 'Bytes written')" "$(stat_value 'EB-level bytes')" \
+         "$(stat_value 'Page-level bytes')" "$(stat_value 'Erase blocks worn')" \
+         "$(( (end - start) / 1000000 ))"
+}
+
+# full rewrite of TARGET, the discard is timed separately by mender-flash
+run_rewrite() {
+  local name="$1"
+  shift
+
+  local start=$(date +%s%N)
+  $MEN_FLASH -w "$@" -i "$BASE" -o "$TARGET" > "$STATS" || return 1
+  local end=$(date +%s%N)
+
+  cmp -s -n $((SIZE_MB * BLOCK)) "$BASE" "$TARGET" || { echo "$name: input and output differ"; return 1; }
+
+  local discard_ms="$(stat_value 'Discard time (ms)')"
+  printf "%-20s %12s %8s\n" "$name" "${discard_ms:--}" "$(( (end - start) / 1000000 ))"
+}
+
+BENCH_DIR="${BENCH_DIR:-$(mktemp -t -d mender-flash-bench-dir-XXXXXX)}"
+BASE="${BENCH_DIR}/base.img"
+INPUT="${BENCH_DIR}/input.img"
+OUTPUT="${BENCH_DIR}/output.img"
+STATS="${BENCH_DIR}/stats"
+trap "rm -f \"$BASE\" \"$INPUT\" \"$OUTPUT\" \"$STATS\"" EXIT
+
+dd if=/dev/urandom of="$BASE" bs=$BLOCK count=$SIZE_MB >/dev/null 2>&1 || exit 1
+
+echo "Image: $SIZE_MB MiB, erase block: $ERASE_SIZE B"
+printf "%-20s %12s %14s %14s %10s %8s\n" "scenario" "written (B)" "EB-level (B)" "page-level (B)" "EBs worn" "ms"
+
+failed=0
+for scenario in no_change scattered_pages contiguous_8mib ten_percent_blocks; do
+  run_scenario $scenario || failed=$((failed + 1))
+done
+
+TARGET="${BENCH_TARGET:-${BENCH_DIR}/target.img}"
+if [ -z "$BENCH_TARGET" ]; then
+  trap "rm -f \"$BASE\" \"$INPUT\" \"$OUTPUT\" \"$STATS\" \"$TARGET\"" EXIT
+fi
+echo
+echo "Full rewrites of $TARGET"
+printf "%-20s %12s %8s\n" "mode" "discard (ms)" "ms"
+run_rewrite rewrite || failed=$((failed + 1))
+run_rewrite rewrite_discard --discard || failed=$((failed + 1))
+exit $failed
@@ -0,0 +1,277 @@
+// Copyright 2023 Northern.tech AS
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/* Reading and writing of the image index, see index.h for the format. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+
+void index_block_init(struct IndexBlock *block, const unsigned char *data, size_t len) {
+	memset(block, 0, sizeof(*block));
+	if ((len > 0) && (memcmp(data, data + 1, len - 1) == 0)) {
+	    block->kind = INDEX_FILL;
+	    block->fill = data[0];
+	} else {
+	    block->kind = INDEX_DATA;
+	    sha256(data, len, block->hash);
+	}
+}
+
+size_t index_block_len(const struct Index *index, uint64_t block) {
+	if (block >= index->n_blocks) {
+	    return 0;
+	}
+	uint64_t rem = index->image_size - block * index->block_size;
+	return (rem < index->block_size) ? rem : index->block_size;
+}
+
+bool index_block_matches(const struct Index *index, uint64_t block,
+                         const unsigned char *data, size_t len) {
+	if ((len == 0) || (len != index_block_len(index, block))) {
+	    return false;
+	}
+	const struct IndexBlock *entry = &index->blocks[block];
+	if (entry->kind == INDEX_FILL) {
+	    return (data[0] == entry->fill) && (memcmp(data, data + 1, len - 1) == 0);
+	}
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	sha256(data, len, digest);
+	return (memcmp(digest, entry->hash, SHA256_DIGEST_SIZE) == 0);
+}
+
+static bool is_zero(const struct IndexBlock *block) {
+	return (block->kind == INDEX_FILL) && (block->fill == 0);
+}
+
+bool index_build_extents(struct Index *index) {
+	free(index->extents);
+	index->extents = NULL;
+	index->n_extents = 0;
+	size_t capacity = 0;
+	for (uint64_t i = 0; i < index->n_blocks; i++) {
+	    if (is_zero(&index->blocks[i])) {
+	        continue;
+	    }
+	    if ((index->n_extents > 0) &&
+	        (index->extents[index->n_extents - 1].first_block +
+	         index->extents[index->n_extents - 1].n_blocks == i)) {
+	        index->extents[index->n_extents - 1].n_blocks++;
+	        continue;
+	    }
+	    if (index->n_extents == capacity) {
+	        capacity = (capacity == 0) ? 64 : 2 * capacity;
+	        struct IndexExtent *extents = realloc(index->extents, capacity * sizeof(*extents));
+	        if (extents == NULL) {
+	            return false;
+	        }
+	        index->extents = extents;
+	    }
+	    index->extents[index->n_extents].first_block = i;
+	    index->extents[index->n_extents].n_blocks = 1;
+	    index->n_extents++;
+	}
+	return true;
+}
+
+static unsigned char *put_le(unsigned char *p, uint64_t value, int n_bytes) {
+	for (int i = 0; i < n_bytes; i++) {
+	    *p++ = (value >> (8 * i)) & 0xff;
+	}
+	return p;
+}
+
+uint64_t get_le(const unsigned char *p, int n_bytes) {
+	uint64_t value = 0;
+	for (int i = n_bytes - 1; i >= 0; i--) {
+	    value = (value << 8) | p[i];
+	}
+	return value;
+}
+
+bool index_save(const struct Index *index, const char *path) {
+	size_t size = INDEX_HEADER_SIZE + index->n_blocks * (1 + SHA256_DIGEST_SIZE) +
+	              index->n_extents * 16 + index->n_verity * SHA256_DIGEST_SIZE +
+	              SHA256_DIGEST_SIZE;
+	unsigned char *buf = malloc(size);
+	if (buf == NULL) {
+	    return false;
+	}
+
+	unsigned char *p = buf;
+	memset(p, 0, 8);
+	memcpy(p, INDEX_MAGIC, strlen(INDEX_MAGIC));
+	p += 8;
+	p = put_le(p, INDEX_VERSION, 4);
+	p = put_le(p, index->block_size, 4);
+	p = put_le(p, index->image_size, 8);
+	p = put_le(p, index->verity_block_size, 4);
+	p = put_le(p, 0, 4);
+	memcpy(p, index->fingerprint, SHA256_DIGEST_SIZE);
+	p += SHA256_DIGEST_SIZE;
+	p = put_le(p, index->n_extents, 8);
+	for (uint64_t i = 0; i < index->n_blocks; i++) {
+	    *p++ = index->blocks[i].kind;
+	    if (index->blocks[i].kind == INDEX_FILL) {
+	        *p++ = index->blocks[i].fill;
+	    } else {
+	        memcpy(p, index->blocks[i].hash, SHA256_DIGEST_SIZE);
+	        p += SHA256_DIGEST_SIZE;
+	    }
+	}
+	for (uint64_t i = 0; i < index->n_extents; i++) {
+	    p = put_le(p, index->extents[i].first_block, 8);
+	    p = put_le(p, index->extents[i].n_blocks, 8);
+	}
+	memcpy(p, index->verity, index->n_verity * SHA256_DIGEST_SIZE);
+	p += index->n_verity * SHA256_DIGEST_SIZE;
+	sha256(buf, p - buf, p);
+	p += SHA256_DIGEST_SIZE;
+
+	bool success = false;
+	FILE *f = fopen(path, "w");
+	if (f != NULL) {
+	    success = (fwrite(buf, 1, p - buf, f) == (size_t) (p - buf));
+	    success = (fclose(f) == 0) && success;
+	}
+	free(buf);
+	return success;
+}
+
+/* Parses the index file contents, returns false if they are not a valid index
+ * (or on allocation failure, with errno set to ENOMEM). */
+static bool index_parse(struct Index *index, const unsigned char *buf, size_t size) {
+	errno = 0;
+	if ((size < INDEX_HEADER_SIZE + SHA256_DIGEST_SIZE) ||
+	    (memcmp(buf, INDEX_MAGIC, strlen(INDEX_MAGIC) + 1) != 0) ||
+	    (get_le(buf + 8, 4) != INDEX_VERSION)) {
+	    return false;
+	}
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	size -= SHA256_DIGEST_SIZE;
+	sha256(buf, size, digest);
+	if (memcmp(digest, buf + size, SHA256_DIGEST_SIZE) != 0) {
+	    return false;
+	}
+
+	const unsigned char *p = buf + 12;
+	const unsigned char *end = buf + size;
+	index->block_size = get_le(p, 4);
+	index->image_size = get_le(p + 4, 8);
+	index->verity_block_size = get_le(p + 12, 4);
+	memcpy(index->fingerprint, p + 20, SHA256_DIGEST_SIZE);
+	index->n_extents = get_le(p + 20 + SHA256_DIGEST_SIZE, 8);
+	p = buf + INDEX_HEADER_SIZE;
+	if ((index->block_size == 0) || (index->image_size == 0)) {
+	    return false;
+	}
+	index->n_blocks = (index->image_size + index->block_size - 1) / index->block_size;
+	if (index->verity_block_size != 0) {
+	    index->n_verity = (index->image_size + index->verity_block_size - 1) /
+	                      index->verity_block_size;
+	}
+	/* the smallest possible entries, bounds the allocations below */
+	if ((index->n_blocks > (size_t) (end - p) / 2) ||
+	    (index->n_extents > index->n_blocks) ||
+	    (index->n_verity > (size_t) (end - p) / SHA256_DIGEST_SIZE)) {
+	    return false;
+	}
+
+	index->blocks = calloc(index->n_blocks, sizeof(*index->blocks));
+	index->extents = calloc(index->n_extents + 1, sizeof(*index->extents));
+	index->verity = malloc(index->n_verity * SHA256_DIGEST_SIZE + 1);
+	if ((index->blocks == NULL) || (index->extents == NULL) || (index->verity == NULL)) {
+	    errno = ENOMEM;
+	    return false;
+	}
+	for (uint64_t i = 0; i < index->n_blocks; i++) {
+	    if (p >= end) {
+	        return false;
+	    }
+	    index->blocks[i].kind = *p++;
+	    if ((index->blocks[i].kind == INDEX_FILL) && (p < end)) {
+	        index->blocks[i].fill = *p++;
+	    } else if ((index->blocks[i].kind == INDEX_DATA) && (end - p >= SHA256_DIGEST_SIZE)) {
+	        memcpy(index->blocks[i].hash, p, SHA256_DIGEST_SIZE);
+	        p += SHA256_DIGEST_SIZE;
+	    } else {
+	        return false;
+	    }
+	}
+	if ((size_t) (end - p) != (index->n_extents * 16 + index->n_verity * SHA256_DIGEST_SIZE)) {
+	    return false;
+	}
+	for (uint64_t i = 0; i < index->n_extents; i++) {
+	    index->extents[i].first_block = get_le(p, 8);
+	    index->extents[i].n_blocks = get_le(p + 8, 8);
+	    p += 16;
+	}
+	memcpy(index->verity, p, index->n_verity * SHA256_DIGEST_SIZE);
+	return true;
+}
+
+bool index_load(struct Index *index, const char *path) {
+	memset(index, 0, sizeof(*index));
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+	    return false;
+	}
+	unsigned char *buf = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+	size_t n_read;
+	do {
+	    if (size == capacity) {
+	        capacity = (capacity == 0) ? 64 * 1024 : 2 * capacity;
+	        unsigned char *new_buf = realloc(buf, capacity);
+	        if (new_buf == NULL) {
+	            free(buf);
+	            fclose(f);
+	            return false;
+	        }
+	        buf = new_buf;
+	    }
+	    n_read = fread(buf + size, 1, capacity - size, f);
+	    size += n_read;
+	} while (n_read > 0);
+	bool read_error = ferror(f);
+	fclose(f);
+	if (read_error) {
+	    free(buf);
+	    errno = EIO;
+	    return false;
+	}
+
+	bool valid = index_parse(index, buf, size);
+	free(buf);
+	if (!valid) {
+	    index_free(index);
+	    if (errno != ENOMEM) {
+	        errno = EINVAL;
+	    }
+	}
+	return valid;
+}
+
+void index_free(struct Index *index) {
+	free(index->blocks);
+	free(index->extents);
+	free(index->verity);
+	index->blocks = NULL;
+	index->extents = NULL;
+	index->verity = NULL;
+}
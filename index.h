@@ -0,0 +1,108 @@
+// Copyright 2023 Northern.tech AS
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#ifndef MENDER_FLASH_INDEX_H
+#define MENDER_FLASH_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/***
+    Image index, produced on the build host by mender-flash-index and consumed
+    by mender-flash (--index) to plan skips and verify the input before and
+    while it arrives. All integers are little-endian. The file starts with
+
+        char     magic[8];            "MFINDEX\0"
+        uint32_t version;             1
+        uint32_t block_size;          size of the indexed blocks
+        uint64_t image_size;
+        uint32_t verity_block_size;   0 if there are no verity leaf hashes
+        uint32_t reserved;            0
+        uint8_t  fingerprint[32];     SHA-256 of the whole image
+        uint64_t n_extents;
+
+    followed by one entry per block (the last one may be short)
+
+        uint8_t  kind;                INDEX_DATA or INDEX_FILL
+        uint8_t  hash[32];            SHA-256 of the block, INDEX_DATA only
+        uint8_t  fill;                the repeated byte, INDEX_FILL only
+
+    then the bmap-like extents of blocks that are not all zeros
+
+        uint64_t first_block;
+        uint64_t n_blocks;
+
+    then, if verity_block_size is not 0, the dm-verity leaf hashes (salt-less
+    SHA-256 of each verity block, the last one zero-padded) and finally the
+    SHA-256 of everything before it.
+***/
+
+#define INDEX_MAGIC "MFINDEX"
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 72
+
+enum IndexKind {
+	INDEX_DATA = 0,
+	INDEX_FILL = 1,
+};
+
+struct IndexBlock {
+	uint8_t kind;
+	uint8_t fill;
+	unsigned char hash[SHA256_DIGEST_SIZE];
+};
+
+struct IndexExtent {
+	uint64_t first_block;
+	uint64_t n_blocks;
+};
+
+struct Index {
+	uint32_t block_size;
+	uint64_t image_size;
+	unsigned char fingerprint[SHA256_DIGEST_SIZE];
+	uint64_t n_blocks;
+	struct IndexBlock *blocks;
+	uint64_t n_extents;
+	struct IndexExtent *extents;
+	uint32_t verity_block_size;
+	uint64_t n_verity;
+	unsigned char *verity;          /* n_verity * SHA256_DIGEST_SIZE bytes */
+};
+
+/* Classifies and hashes one block of data. */
+void index_block_init(struct IndexBlock *block, const unsigned char *data, size_t len);
+
+/* Length of the given block (only the last one can be short). */
+size_t index_block_len(const struct Index *index, uint64_t block);
+
+/* Whether data matches the given block of the index. */
+bool index_block_matches(const struct Index *index, uint64_t block,
+                         const unsigned char *data, size_t len);
+
+/* Computes the extents from the blocks. */
+bool index_build_extents(struct Index *index);
+
+/* Reads an n_bytes long little-endian integer (as used by the index and the
+ * framed input). */
+uint64_t get_le(const unsigned char *p, int n_bytes);
+
+bool index_save(const struct Index *index, const char *path);
+bool index_load(struct Index *index, const char *path);
+void index_free(struct Index *index);
+
+#endif  /* MENDER_FLASH_INDEX_H */
@@ -17,23 +17,87 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
 #include <mtd/ubi-user.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/sysmacros.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <linux/if_alg.h>
+#include <linux/perf_event.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#endif  /* __linux__ */
+
 #include "config.h"
+#include "index.h"
+#include "sha256.h"
+#include "stats_page.h"
 
-#define UBIMajorDevNo 10
 #define BLOCK_SIZE (1024*1024L)   /* 1 MiB */
+#define WEAR_PAGE_SIZE 4096
+#define DEFAULT_RING_SIZE (8 * BLOCK_SIZE)   /* 8 MiB */
+#define DEFAULT_READAHEAD_SIZE (16 * BLOCK_SIZE)   /* 16 MiB */
+#define READAHEAD_MAX_WORKERS 8
+#define READAHEAD_MAX_READ_BLOCKS 8
+#define READAHEAD_LOW_LATENCY_US 500
+#define MEM_CHECK_INTERVAL_US 1000000
+/* from <linux/fs.h>, which would clash with BLOCK_SIZE */
+#ifndef BLKSSZGET
+#define BLKSSZGET _IO(0x12, 104)
+#endif
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12, 119)
+#endif
+#define MEM_BUDGET_DIVISOR 8
+#define MEM_PRESSURE_LOW 1.0    /* % of time stalled, PSI "some avg10" */
+#define MEM_PRESSURE_HIGH 10.0
+#define THROTTLE_INTERVAL_US 100000
+#define THROTTLE_PRESSURE_LOW 5.0    /* % of time stalled on I/O */
+#define THROTTLE_PRESSURE_HIGH 20.0
+#define THROTTLE_MAX_INFLIGHT 32    /* requests queued on the target */
+#define THROTTLE_MIN_RATE BLOCK_SIZE    /* bytes/s */
+#define THROTTLE_RATE_STEP (4 * BLOCK_SIZE)    /* bytes/s per interval */
 #define MIN(X, Y) ((X < Y) ? X : Y)
+#define MAX(X, Y) ((X > Y) ? X : Y)
+
+/* Values for long options without a short equivalent. */
+enum {
+	OPT_RING_SIZE = 256,
+	OPT_ERASE_SIZE,
+	OPT_EXPECT_SHA256,
+	OPT_CHECKPOINT,
+	OPT_READAHEAD,
+	OPT_FRAMED,
+	OPT_HISTORY,
+	OPT_PERF_COUNTERS,
+	OPT_INDEX,
+	OPT_IO_THROTTLE,
+	OPT_VERIFY_SAMPLE,
+	OPT_BATCH_SIZE,
+	OPT_ENGINE,
+	OPT_DISCARD,
+	OPT_STATS_SHM,
+	OPT_ADAPT_MEMORY,
+};
 
 static struct option long_options[] = {
 	{"help", no_argument, 0, 'h'},
@@ -42,12 +106,60 @@ static struct option long_options[] = {
 	{"fsync-interval", required_argument, 0, 'f'},
 	{"input", required_argument, 0, 'i'},
 	{"output", required_argument, 0, 'o'},
+	{"ring-size", required_argument, 0, OPT_RING_SIZE},
+	{"erase-size", required_argument, 0, OPT_ERASE_SIZE},
+	{"expect-sha256", required_argument, 0, OPT_EXPECT_SHA256},
+	{"checkpoint", required_argument, 0, OPT_CHECKPOINT},
+	{"readahead", required_argument, 0, OPT_READAHEAD},
+	{"framed", no_argument, 0, OPT_FRAMED},
+	{"history", required_argument, 0, OPT_HISTORY},
+	{"perf-counters", no_argument, 0, OPT_PERF_COUNTERS},
+	{"index", required_argument, 0, OPT_INDEX},
+	{"io-throttle", no_argument, 0, OPT_IO_THROTTLE},
+	{"verify-sample", required_argument, 0, OPT_VERIFY_SAMPLE},
+	{"batch-size", required_argument, 0, OPT_BATCH_SIZE},
+	{"engine", required_argument, 0, OPT_ENGINE},
+	{"discard", no_argument, 0, OPT_DISCARD},
+	{"stats-shm", required_argument, 0, OPT_STATS_SHM},
+	{"adapt-memory", no_argument, 0, OPT_ADAPT_MEMORY},
+	{"verbose", no_argument, 0, 'v'},
 	{0, 0, 0, 0}};
 
 void PrintHelp() {
 	fputs(
 		"Usage:\n"
-		"  mender-flash [-h|--help] [-w|--write-everything] [-s|--input-size <INPUT_SIZE>] [-f|--fsync-interval <FSYNC_INTERVAL>] -i|--input <INPUT_PATH> -o|--output <OUTPUT_PATH>\n",
+		"  mender-flash [-h|--help] [-w|--write-everything] [-s|--input-size <INPUT_SIZE>] [-f|--fsync-interval <FSYNC_INTERVAL>] -i|--input <INPUT_PATH> -o|--output <OUTPUT_PATH>\n"
+		"\n"
+		"Advanced options:\n"
+		"  --ring-size <BYTES>       memory cap for buffering pipe input (0 to disable), only\n"
+		"                            used when the data pass through user space (not by splice)\n"
+		"  --erase-size <BYTES>      report write amplification and wear for this erase block size\n"
+		"  --expect-sha256 <HEX>     fail unless the SHA-256 checksum of the input matches\n"
+		"  --checkpoint <PATH>       save progress at every fsync and resume from it if it exists\n"
+		"                            (after comparing the input with the target, unless\n"
+		"                            --expect-sha256 is given)\n"
+		"                            (pipe input is expected to start at the saved offset)\n"
+		"  --readahead <BYTES>       memory cap for concurrent reads of seekable input\n"
+		"                            (default: 16 MiB on network filesystems, 0 to disable)\n"
+		"  --framed                  input is in the framed format, -i can be given multiple times\n"
+		"                            (\"fd:N\" reads from an inherited file descriptor)\n"
+		"  --history <PATH>          append a summary of the run to this file and compare it with\n"
+		"                            the previous runs on the same target\n"
+		"  --perf-counters           report hardware performance counters per GiB and phase\n"
+		"  --index <PATH>            verify the input against an index made by mender-flash-index\n"
+		"                            and compare the target with it before any input arrives\n"
+		"  --io-throttle             slow writing down while other tasks are stalling on I/O\n"
+		"  --verify-sample <N|FRACTION>  read back this many (or this fraction of) random blocks\n"
+		"                            after the final sync and compare them with the input\n"
+		"  --batch-size <BYTES>      compare and write in windows of this size (e.g. 16-64 MiB)\n"
+		"  --engine <NAME>           auto (default, the fastest one usable), user, batch, splice,\n"
+		"                            sendfile or copy_file_range\n"
+		"  --discard                 discard the target range before rewriting it (with -w)\n"
+		"  --stats-shm <NAME|fd:N>   keep live statistics in this shared memory object (or in\n"
+		"                            an inherited memfd), see stats_page.h\n"
+		"  --adapt-memory            shrink the input buffers and, unless -f is given, the\n"
+		"                            write-behind window under memory pressure\n"
+		"  -v|--verbose              trace adaptive decisions to stderr\n",
 		stderr);
 }
 
@@ -59,6 +171,36 @@ struct Stats {
 	uint64_t bytes_written;
 	uint64_t bytes_omitted;
 	uint64_t total_bytes;
+	uint64_t resumed_offset;
+	uint64_t bytes_cached;
+	uint64_t bytes_page_dirty;
+	uint64_t bytes_eb_dirty;
+	uint64_t erase_blocks_worn;
+	uint64_t ring_high_water;
+	size_t ring_stalls;
+	size_t readahead_inflight;
+	size_t readahead_read_size;
+	uint64_t readahead_latency_us;
+	size_t readahead_waits;
+	bool mem_adapted;
+	unsigned int mem_pct;         /* % of the configured buffer limits in use */
+	unsigned int mem_pct_low;
+	size_t mem_trims;
+	size_t throttle_backoffs;
+	size_t throttle_rampups;
+	uint64_t throttle_min_rate;
+	uint64_t throttle_sleep_us;
+	size_t blocks_verified;
+	size_t blocks_planned;
+	size_t lebs_changed;
+	size_t lebs_unchanged;
+	size_t lebs_unmapped;
+	uint64_t bytes_discarded;
+	size_t discards;
+	uint64_t discard_us;
+	uint32_t *fsync_us;
+	size_t n_fsyncs;
+	size_t fsync_capacity;
 };
 
 ssize_t buf_io(io_fn_t io_fn, int fd, unsigned char *buf, size_t len) {
@@ -81,89 +223,3520 @@ ssize_t buf_io(io_fn_t io_fn, int fd, unsigned char *buf, size_t len) {
 	}
 }
 
-bool shovel_data(int in_fd, int out_fd, size_t len, bool write_optimized, size_t fsync_interval,
-	             struct Stats *stats, int *error) {
-	unsigned char buffer[BLOCK_SIZE];
-	size_t n_unsynced = 0;
-	while (len > 0) {
-	    ssize_t n_read = buf_io((io_fn_t)read, in_fd, buffer, MIN(BLOCK_SIZE, len));
-	    if (n_read < 0) {
-	        fprintf(stderr, "Failed to read data: %m\n");
-	        *error = errno;
+/***
+    Optional hardware performance counters (perf_event_open()) to tell whether
+    a slow run was bound by memory bandwidth (comparing) or by syscalls. The
+    counters are read at every switch between the phases of the engine and the
+    differences are accounted to the phase that just ended. Only the thread
+    running the engine is measured, not the helper threads for input.
+***/
+enum Phase {
+	PHASE_INPUT,
+	PHASE_COMPARE,
+	PHASE_WRITE,
+	PHASE_SYNC,
+	PHASE_OTHER,
+	N_PHASES,
+};
+
+static const char *const phase_names[N_PHASES] = {
+	"input", "compare", "write", "sync", "other",
+};
+
+#define N_PERF_COUNTERS 5
+
+static const char *const perf_counter_names[N_PERF_COUNTERS] = {
+	"cycles", "instructions", "cache-misses", "branch-misses", "context-switches",
+};
+
+struct PerfCounters {
+	bool enabled;
+	int fds[N_PERF_COUNTERS];
+	int leader;
+	/* indices of the counters in the group read, -1 if not available */
+	int index[N_PERF_COUNTERS];
+	size_t n_open;
+	enum Phase phase;
+	uint64_t last[N_PERF_COUNTERS];
+	uint64_t last_enabled;
+	uint64_t last_running;
+	uint64_t totals[N_PHASES][N_PERF_COUNTERS];
+};
+
+static struct PerfCounters perf_counters = { .enabled = false };
+
+#ifdef __linux__
+static int perf_open(uint32_t type, uint64_t config, int group_fd) {
+	struct perf_event_attr attr = {
+		.type = type,
+		.size = sizeof(struct perf_event_attr),
+		.config = config,
+		.read_format = (PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+		                PERF_FORMAT_TOTAL_TIME_RUNNING),
+		.disabled = (group_fd == -1),
+		.exclude_hv = 1,
+	};
+	int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+	if ((fd == -1) && (errno == EACCES)) {
+		/* perf_event_paranoid may only allow user space measurements */
+		attr.exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+	}
+	return fd;
+}
+
+static bool perf_read(struct PerfCounters *pc, uint64_t values[N_PERF_COUNTERS],
+                      uint64_t *enabled, uint64_t *running) {
+	uint64_t buf[3 + N_PERF_COUNTERS];
+	ssize_t ret = read(pc->leader, buf, sizeof(buf));
+	if ((ret < (ssize_t) (3 * sizeof(uint64_t))) || (buf[0] != pc->n_open)) {
+		return false;
+	}
+	*enabled = buf[1];
+	*running = buf[2];
+	for (int i = 0; i < N_PERF_COUNTERS; i++) {
+		values[i] = (pc->index[i] >= 0) ? buf[3 + pc->index[i]] : 0;
+	}
+	return true;
+}
+#endif  /* __linux__ */
+
+/* Sets up and starts the counters. Returns false if none is available. */
+bool perf_start() {
+	struct PerfCounters *pc = &perf_counters;
+#ifdef __linux__
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[N_PERF_COUNTERS] = {
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	};
+	pc->leader = -1;
+	pc->n_open = 0;
+	int saved_errno = 0;
+	for (int i = 0; i < N_PERF_COUNTERS; i++) {
+		pc->fds[i] = perf_open(events[i].type, events[i].config, pc->leader);
+		if (pc->fds[i] == -1) {
+			saved_errno = errno;
+			pc->index[i] = -1;
+			continue;
+		}
+		if (pc->leader == -1) {
+			pc->leader = pc->fds[i];
+		}
+		pc->index[i] = pc->n_open++;
+	}
+	if (pc->leader == -1) {
+		errno = saved_errno;
+		return false;
+	}
+	ioctl(pc->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(pc->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	pc->phase = PHASE_OTHER;
+	pc->enabled = perf_read(pc, pc->last, &pc->last_enabled, &pc->last_running);
+	return pc->enabled;
+#else
+	(void) pc;
+	errno = ENOSYS;
+	return false;
+#endif  /* __linux__ */
+}
+
+/* Accounts the counters since the last switch to the current phase. */
+static void perf_account(struct PerfCounters *pc) {
+#ifdef __linux__
+	uint64_t values[N_PERF_COUNTERS];
+	uint64_t enabled, running;
+	if (perf_read(pc, values, &enabled, &running)) {
+		/* scale up if the counters were multiplexed with other users */
+		uint64_t d_enabled = enabled - pc->last_enabled;
+		uint64_t d_running = running - pc->last_running;
+		for (int i = 0; i < N_PERF_COUNTERS; i++) {
+			uint64_t delta = values[i] - pc->last[i];
+			if ((d_running > 0) && (d_running < d_enabled)) {
+				delta = (uint64_t) ((double) delta * d_enabled / d_running);
+			}
+			pc->totals[pc->phase][i] += delta;
+			pc->last[i] = values[i];
+		}
+		pc->last_enabled = enabled;
+		pc->last_running = running;
+	}
+#else
+	(void) pc;
+#endif  /* __linux__ */
+}
+
+/* Switches to the given phase of the engine. */
+void perf_phase(enum Phase phase) {
+	struct PerfCounters *pc = &perf_counters;
+	if (!pc->enabled || (phase == pc->phase)) {
+		return;
+	}
+	perf_account(pc);
+	pc->phase = phase;
+}
+
+void perf_stop() {
+	struct PerfCounters *pc = &perf_counters;
+	if (!pc->enabled) {
+		return;
+	}
+	perf_account(pc);
+	pc->enabled = false;
+	for (int i = 0; i < N_PERF_COUNTERS; i++) {
+		if (pc->index[i] >= 0) {
+			close(pc->fds[i]);
+		}
+	}
+}
+
+/* Prints the counters per GiB of data processed, per phase and in total. */
+void perf_print(uint64_t total_bytes) {
+	struct PerfCounters *pc = &perf_counters;
+	double gib = (double) total_bytes / (1024.0 * 1024.0 * 1024.0);
+	if (gib <= 0) {
+		gib = 1;
+	}
+	printf("Perf counters per GiB: %8s", "");
+	for (int i = 0; i < N_PERF_COUNTERS; i++) {
+		printf(" %16s", perf_counter_names[i]);
+	}
+	putchar('\n');
+	uint64_t sums[N_PERF_COUNTERS] = {0};
+	for (int phase = 0; phase <= N_PHASES; phase++) {
+		const uint64_t *values = (phase < N_PHASES) ? pc->totals[phase] : sums;
+		printf("  %-29s", (phase < N_PHASES) ? phase_names[phase] : "total");
+		for (int i = 0; i < N_PERF_COUNTERS; i++) {
+			if (pc->index[i] < 0) {
+				printf(" %16s", "-");
+			} else {
+				printf(" %16.0f", values[i] / gib);
+			}
+			if (phase < N_PHASES) {
+				sums[i] += values[i];
+			}
+		}
+		putchar('\n');
+	}
+}
+
+uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/***
+    Live statistics in shared memory (--stats-shm), see stats_page.h for the
+    layout and how to read it. The engines publish their stats at every
+    chunk; that's a few plain stores between two increments of the sequence
+    number, no syscalls. The throughput (and the ETA derived from it) is
+    taken over windows of at least STATS_RATE_US. The in-kernel copies move at
+    most STATS_COPY_CHUNK per call then.
+***/
+#define STATS_RATE_US 1000000
+#define STATS_COPY_CHUNK (8 * BLOCK_SIZE)   /* 8 MiB */
+
+struct StatsShm {
+	struct StatsPage *page;
+	uint64_t start_us;
+	uint64_t rate_us;             /* start of the current throughput window */
+	uint64_t rate_bytes;
+	uint64_t throughput;
+	bool write_everything;        /* -w, everything copied is written */
+	enum StatsPagePhase phase;
+};
+
+static struct StatsShm stats_shm = { .page = NULL };
+
+/* Opens (or creates) the named shared memory object, or uses the inherited
+ * file descriptor given as "fd:N" (e.g. a memfd of the parent). */
+bool stats_shm_open(const char *spec, uint64_t total_size, bool write_everything) {
+	int fd;
+	bool inherited = (strncmp(spec, "fd:", 3) == 0);
+	if (inherited) {
+	    char *end;
+	    long ret = strtol(spec + 3, &end, 10);
+	    if ((spec[3] == '\0') || (*end != '\0') || (ret < 0) || (ret > INT_MAX)) {
+	        errno = EINVAL;
 	        return false;
 	    }
-	    if ((n_read == 0) && (len > 0)) {
-	        fprintf(stderr, "Unexpected end of input!\n");
+	    fd = ret;
+	} else {
+	    char name[NAME_MAX + 1];
+	    snprintf(name, sizeof(name), "%s%s", (spec[0] == '/') ? "" : "/", spec);
+	    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	    if (fd == -1) {
 	        return false;
 	    }
-	    if (write_optimized) {
-	        unsigned char out_fd_buffer[BLOCK_SIZE];
-	        ssize_t out_fd_n_read = buf_io((io_fn_t)read, out_fd, out_fd_buffer, MIN(BLOCK_SIZE, len));
-	        if (out_fd_n_read < 0) {
-	            fprintf(stderr, "Failed to read data from the target: %m\n");
-	            *error = errno;
-	            return false;
+	}
+	struct stat st;
+	void *page = MAP_FAILED;
+	if ((fstat(fd, &st) == 0) &&
+	    ((st.st_size >= (off_t) sizeof(struct StatsPage)) ||
+	     (ftruncate(fd, sizeof(struct StatsPage)) == 0))) {
+	    page = mmap(NULL, sizeof(struct StatsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	int saved_errno = errno;
+	close(fd);
+	if (page == MAP_FAILED) {
+	    errno = saved_errno;
+	    return false;
+	}
+
+	struct StatsPage *p = page;
+	memset(p, 0, sizeof(*p));
+	memcpy(p->magic, STATS_PAGE_MAGIC, strlen(STATS_PAGE_MAGIC));
+	p->version = STATS_PAGE_VERSION;
+	p->size = sizeof(*p);
+	p->pid = getpid();
+	p->total_size = total_size;
+	stats_shm.page = p;
+	stats_shm.start_us = now_us();
+	stats_shm.rate_us = stats_shm.start_us;
+	stats_shm.write_everything = write_everything;
+	stats_shm.phase = STATS_PHASE_STARTING;
+	return true;
+}
+
+/* Publishes the stats (in the current phase) if there's a page. */
+void stats_shm_publish(const struct Stats *stats) {
+	struct StatsShm *s = &stats_shm;
+	if (s->page == NULL) {
+	    return;
+	}
+	uint64_t now = now_us();
+	if (now - s->rate_us >= STATS_RATE_US) {
+	    s->throughput = (stats->total_bytes - s->rate_bytes) * 1000000 / (now - s->rate_us);
+	    s->rate_us = now;
+	    s->rate_bytes = stats->total_bytes;
+	}
+	struct StatsPage *p = s->page;
+	uint64_t seq = atomic_load_explicit(&p->seq, memory_order_relaxed);
+	atomic_store_explicit(&p->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	p->phase = s->phase;
+	p->total_bytes = stats->total_bytes;
+	/* as in the history, the blocks aren't counted for -w */
+	p->bytes_written = s->write_everything ? stats->total_bytes : stats->bytes_written;
+	p->blocks_written = stats->blocks_written;
+	p->blocks_omitted = stats->blocks_omitted;
+	p->resumed_offset = stats->resumed_offset;
+	p->n_fsyncs = stats->n_fsyncs;
+	p->elapsed_us = now - s->start_us;
+	p->throughput = s->throughput;
+	if ((s->throughput > 0) && (p->total_size > stats->total_bytes)) {
+	    p->eta_us = (p->total_size - stats->total_bytes) * 1000000 / s->throughput;
+	} else {
+	    p->eta_us = 0;
+	}
+	atomic_store_explicit(&p->seq, seq + 2, memory_order_release);
+}
+
+/* Switches to the given phase, publishing it right away. */
+void stats_shm_phase(enum StatsPagePhase phase, const struct Stats *stats) {
+	stats_shm.phase = phase;
+	stats_shm_publish(stats);
+}
+
+void record_fsync_latency(struct Stats *stats, uint64_t latency_us) {
+	if (stats->n_fsyncs == stats->fsync_capacity) {
+	    size_t capacity = (stats->fsync_capacity == 0) ? 64 : 2 * stats->fsync_capacity;
+	    uint32_t *fsync_us = realloc(stats->fsync_us, capacity * sizeof(uint32_t));
+	    if (fsync_us == NULL) {
+	        return;
+	    }
+	    stats->fsync_us = fsync_us;
+	    stats->fsync_capacity = capacity;
+	}
+	stats->fsync_us[stats->n_fsyncs++] = (latency_us > UINT32_MAX) ? UINT32_MAX : latency_us;
+}
+
+/* fsync() recording its latency in the stats. */
+/* Only touches stats, so the framed input's worker threads can use it. */
+int stream_fsync(int fd, struct Stats *stats) {
+	uint64_t start = now_us();
+	int ret = fsync(fd);
+	record_fsync_latency(stats, now_us() - start);
+	return ret;
+}
+
+int timed_fsync(int fd, struct Stats *stats) {
+	enum Phase prev_phase = perf_counters.phase;
+	perf_phase(PHASE_SYNC);
+	enum StatsPagePhase prev_shm_phase = stats_shm.phase;
+	stats_shm_phase(STATS_PHASE_SYNCING, stats);
+	int ret = stream_fsync(fd, stats);
+	stats_shm_phase(prev_shm_phase, stats);
+	perf_phase(prev_phase);
+	return ret;
+}
+
+typedef ssize_t (*pio_fn_t)(int, void*, size_t, off_t);
+
+ssize_t buf_pio(pio_fn_t io_fn, int fd, unsigned char *buf, size_t len, off_t offset) {
+	size_t rem = len;
+	ssize_t n_done;
+	do {
+	    n_done = io_fn(fd, buf + (len - rem), rem, offset + (len - rem));
+	    if (n_done > 0) {
+	        rem -= n_done;
+	    }
+	    else if ((n_done == -1) && (errno == EINTR)) {
+	        continue;
+	    }
+	} while ((n_done > 0) && (rem > 0) && (len > 0));
+
+	if (n_done < 0) {
+	    return n_done;
+	} else {
+	    return (len - rem);
+	}
+}
+
+#ifdef RWF_NOWAIT
+static atomic_bool nowait_supported = true;
+static atomic_bool nowait_used = false;
+
+/* Reads as much of the given range as is available in the page cache without
+ * blocking on the device. Returns 0 if nothing is cached (or RWF_NOWAIT is not
+ * supported by the target). */
+ssize_t cached_pread(int fd, unsigned char *buf, size_t len, off_t offset) {
+	size_t done = 0;
+	while (nowait_supported && (done < len)) {
+	    struct iovec iov = { .iov_base = buf + done, .iov_len = len - done };
+	    ssize_t ret = preadv2(fd, &iov, 1, offset + done, RWF_NOWAIT);
+	    if (ret > 0) {
+	        done += ret;
+	    } else if ((ret == -1) && (errno == EINTR)) {
+	        continue;
+	    } else {
+	        if ((ret == -1) && (errno != EAGAIN)) {
+	            /* EOPNOTSUPP or ENOSYS, don't waste syscalls on it anymore */
+	            nowait_supported = false;
 	        }
-	        if ((n_read == out_fd_n_read) &&
-	            (memcmp(buffer, out_fd_buffer, n_read) == 0)) {
-	            stats->blocks_omitted++;
-	            stats->total_bytes += n_read;
-	            len -= n_read;
-	            continue;
-	        } else {
-	            if (lseek(out_fd, -out_fd_n_read, SEEK_CUR) == -1) {
-	                fprintf(stderr, "Failed to seek on the target: %m\n");
-	                *error = errno;
-	                return false;
+	        break;
+	    }
+	}
+	if (nowait_supported && !atomic_load_explicit(&nowait_used, memory_order_relaxed)) {
+	    nowait_used = true;
+	}
+	return done;
+}
+#endif  /* RWF_NOWAIT */
+
+/* Whether the target was compared cache-first, i.e. bytes_cached is meaningful. */
+static bool cache_first_active() {
+#ifdef RWF_NOWAIT
+	return nowait_supported && nowait_used;
+#else
+	return false;
+#endif  /* RWF_NOWAIT */
+}
+
+/* Compares len bytes of data with the target at offset using buf as a scratch
+ * buffer. Cached parts of the target are compared first so that a mismatch in
+ * them saves us from waiting for the device to read the uncached rest, unless
+ * exhaustive is true in which case the whole range is always read. The number
+ * of target bytes read into buf is stored in n_target. Returns 1 if the target
+ * holds the same data, 0 if it differs and -1 on error. */
+int compare_target(int out_fd, off_t offset, const unsigned char *data, size_t len,
+                   unsigned char *buf, bool exhaustive, size_t *n_target,
+                   struct Stats *stats) {
+	size_t n_cached = 0;
+	bool differs = false;
+#ifdef RWF_NOWAIT
+	n_cached = cached_pread(out_fd, buf, len, offset);
+	if (n_cached > 0) {
+	    stats->bytes_cached += n_cached;
+	    differs = (memcmp(data, buf, n_cached) != 0);
+	}
+#endif  /* RWF_NOWAIT */
+	*n_target = n_cached;
+	if ((n_cached == len) || (differs && !exhaustive)) {
+	    return differs ? 0 : 1;
+	}
+
+	ssize_t n_read = buf_pio((pio_fn_t)pread, out_fd, buf + n_cached, len - n_cached,
+	                         offset + n_cached);
+	if (n_read < 0) {
+	    return -1;
+	}
+	*n_target += n_read;
+	if (differs || ((size_t) n_read != (len - n_cached))) {
+	    return 0;
+	}
+	return (memcmp(data + n_cached, buf + n_cached, n_read) == 0) ? 1 : 0;
+}
+
+/* The erase blocks last accounted by account_wear() in the current run. */
+struct WearState {
+	uint64_t last_eb_dirty;
+	uint64_t last_eb_worn;
+	bool eb_dirty_valid;
+	bool eb_worn_valid;
+};
+
+/* Accounts the write of len bytes of data at offset, replacing the n_target
+ * bytes of the previous target contents in target, at the page and erase block
+ * granularity to see how much we would submit with smaller writes and how many
+ * erase blocks the actual (BLOCK_SIZE) write wears. */
+void account_wear(struct Stats *stats, struct WearState *wear, size_t erase_size,
+                  off_t offset, const unsigned char *data, size_t len,
+                  const unsigned char *target, size_t n_target) {
+	for (size_t pos = 0; pos < len; pos += WEAR_PAGE_SIZE) {
+	    size_t n = MIN(WEAR_PAGE_SIZE, len - pos);
+	    if ((pos + n <= n_target) && (memcmp(data + pos, target + pos, n) == 0)) {
+	        continue;
+	    }
+	    stats->bytes_page_dirty += n;
+
+	    uint64_t eb = (offset + pos) / erase_size;
+	    if (!wear->eb_dirty_valid || (eb != wear->last_eb_dirty)) {
+	        stats->bytes_eb_dirty += erase_size;
+	        wear->last_eb_dirty = eb;
+	        wear->eb_dirty_valid = true;
+	    }
+	}
+
+	uint64_t first_eb = offset / erase_size;
+	uint64_t last_eb = (offset + len - 1) / erase_size;
+	if (wear->eb_worn_valid && (first_eb == wear->last_eb_worn)) {
+	    first_eb++;
+	}
+	if (last_eb >= first_eb) {
+	    stats->erase_blocks_worn += (last_eb - first_eb + 1);
+	}
+	wear->last_eb_worn = last_eb;
+	wear->eb_worn_valid = true;
+}
+
+/***
+    Memory-pressure awareness. The input buffers (ring, read-ahead) and the
+    amount of data written between fsync() calls (the write-behind window,
+    i.e. dirty page cache) are sized from the configured limits, scaled down
+    when the system is short of memory: to at most 1/MEM_BUDGET_DIVISOR of
+    MemAvailable and further when the PSI "some" memory pressure shows that
+    tasks are stalling on reclaim. This is re-evaluated every
+    MEM_CHECK_INTERVAL_US so that the buffers grow back once the pressure is
+    gone and memory is released while it lasts. Only done with --adapt-memory
+    and an explicit -f is always kept as it is.
+
+    Builds with TEST_HOOKS read the MENDER_FLASH_PROC environment variable,
+    a directory used instead of /proc.
+***/
+struct MemState {
+	bool have_psi;
+	double some_avg10;            /* % of time some task stalled on memory */
+	bool have_available;
+	uint64_t available;           /* bytes */
+};
+
+static const char *proc_path(const char *name, char *buf, size_t size) {
+	const char *dir = "/proc";
+#ifdef TEST_HOOKS
+	if (getenv("MENDER_FLASH_PROC") != NULL) {
+	    dir = getenv("MENDER_FLASH_PROC");
+	}
+#endif  /* TEST_HOOKS */
+	snprintf(buf, size, "%s/%s", dir, name);
+	return buf;
+}
+
+/* Reads the "some" line of the given PSI file, the average share of time
+ * stalled over the last 10 seconds (%) and, if some_total is not NULL, the
+ * total time stalled (us). Only the average is required, have_total tells
+ * whether the total was there too. */
+bool psi_read(const char *name, double *some_avg10, uint64_t *some_total, bool *have_total) {
+	char path[PATH_MAX];
+	FILE *f = fopen(proc_path(name, path, sizeof(path)), "r");
+	if (f == NULL) {
+	    return false;
+	}
+	uint64_t total;
+	int n = fscanf(f, "some avg10=%lf avg60=%*f avg300=%*f total=%" SCNu64, some_avg10, &total);
+	if (some_total != NULL) {
+	    *have_total = (n == 2);
+	    *some_total = (n == 2) ? total : 0;
+	}
+	fclose(f);
+	return (n >= 1);
+}
+
+bool mem_state_read(struct MemState *ms) {
+	memset(ms, 0, sizeof(*ms));
+	ms->have_psi = psi_read("pressure/memory", &ms->some_avg10, NULL, NULL);
+
+	char path[PATH_MAX];
+	FILE *f = fopen(proc_path("meminfo", path, sizeof(path)), "r");
+	if (f != NULL) {
+	    char line[128];
+	    uint64_t kib;
+	    while (fgets(line, sizeof(line), f) != NULL) {
+	        if (sscanf(line, "MemAvailable: %" SCNu64 " kB", &kib) == 1) {
+	            ms->available = kib * 1024;
+	            ms->have_available = true;
+	            break;
+	        }
+	    }
+	    fclose(f);
+	}
+	return (ms->have_psi || ms->have_available);
+}
+
+/* How much (in %) of the configured limits, totalling total_limit bytes, we
+ * can afford to use now. */
+unsigned int mem_scale(const struct MemState *ms, uint64_t total_limit) {
+	unsigned int pct = 100;
+	if (ms->have_available && (total_limit > 0) &&
+	    (ms->available / MEM_BUDGET_DIVISOR < total_limit)) {
+	    pct = ms->available / MEM_BUDGET_DIVISOR * 100 / total_limit;
+	}
+	if (ms->have_psi && (ms->some_avg10 >= MEM_PRESSURE_HIGH)) {
+	    pct = 0;
+	} else if (ms->have_psi && (ms->some_avg10 >= MEM_PRESSURE_LOW)) {
+	    pct /= 2;
+	}
+	return pct;
+}
+
+/* Scales a configured limit, but never below the given minimum. */
+size_t mem_scaled(size_t limit, unsigned int pct, size_t min) {
+	size_t scaled = (uint64_t) limit * pct / 100;
+	return (scaled < min) ? MIN(min, limit) : scaled;
+}
+
+/***
+    Adaptive I/O throttle (--io-throttle). Every THROTTLE_INTERVAL_US the
+    share of time tasks stalled on I/O is taken from /proc/pressure/io (the
+    larger of the 10 s average and the change of the total since the last
+    check), together with the number of writes queued on the target if it is
+    a block device. Under pressure the write rate is halved (starting from
+    the rate measured in the last interval), when the system is calm again
+    it grows by THROTTLE_RATE_STEP and is lifted altogether once it no longer
+    holds writing back.
+***/
+struct Throttle {
+	bool verbose;
+	char inflight_path[PATH_MAX];   /* "" if the target is not a block device */
+	uint64_t rate;                  /* bytes/s, 0 for unlimited */
+	uint64_t last_check_us;
+	bool have_psi_total;
+	uint64_t last_psi_total;
+	uint64_t bytes_since_check;
+	bool slept_since_check;
+	uint64_t next_write_us;         /* earliest time the next write may start */
+};
+
+void throttle_init(struct Throttle *t, const struct stat *target_stat, bool verbose) {
+	memset(t, 0, sizeof(*t));
+	t->verbose = verbose;
+	t->last_check_us = now_us();
+	if (S_ISBLK(target_stat->st_mode)) {
+	    snprintf(t->inflight_path, sizeof(t->inflight_path), "/sys/dev/block/%u:%u/inflight",
+	             major(target_stat->st_rdev), minor(target_stat->st_rdev));
+	}
+}
+
+/* Number of writes in flight on the target, -1 if not known. */
+static long throttle_inflight(const struct Throttle *t) {
+	if (t->inflight_path[0] == '\0') {
+	    return -1;
+	}
+	FILE *f = fopen(t->inflight_path, "r");
+	if (f == NULL) {
+	    return -1;
+	}
+	long reads, writes;
+	bool ok = (fscanf(f, "%ld %ld", &reads, &writes) == 2);
+	fclose(f);
+	return ok ? writes : -1;
+}
+
+static void throttle_adjust(struct Throttle *t, uint64_t now, struct Stats *stats) {
+	uint64_t elapsed = now - t->last_check_us;
+	double pressure = 0.0;
+	uint64_t total = 0;
+	bool have_total = false;
+	bool have_psi = psi_read("pressure/io", &pressure, &total, &have_total);
+	have_total = have_psi && have_total;
+	if (have_total && t->have_psi_total && (total >= t->last_psi_total)) {
+	    pressure = MAX(pressure, (double) (total - t->last_psi_total) * 100.0 / elapsed);
+	}
+	t->have_psi_total = have_total;
+	t->last_psi_total = total;
+	long inflight = throttle_inflight(t);
+	uint64_t measured = t->bytes_since_check * 1000000 / elapsed;
+
+	uint64_t rate = t->rate;
+	if ((pressure >= THROTTLE_PRESSURE_HIGH) || (inflight > THROTTLE_MAX_INFLIGHT)) {
+	    if ((rate == 0) || (measured < rate)) {
+	        rate = measured;
+	    }
+	    rate = MAX(rate / 2, THROTTLE_MIN_RATE);
+	    if ((t->bytes_since_check > 0) && (rate != t->rate)) {
+	        stats->throttle_backoffs++;
+	    } else {
+	        /* nothing written, nothing to measure */
+	        rate = t->rate;
+	    }
+	} else if ((pressure < THROTTLE_PRESSURE_LOW) && (rate != 0)) {
+	    rate = t->slept_since_check ? rate + THROTTLE_RATE_STEP : 0;
+	    stats->throttle_rampups++;
+	}
+	if ((rate != 0) && ((stats->throttle_min_rate == 0) || (rate < stats->throttle_min_rate))) {
+	    stats->throttle_min_rate = rate;
+	}
+	if (t->verbose && (rate != t->rate)) {
+	    fprintf(stderr, "io-throttle: pressure %.1f%%, in-flight %ld, measured %ju B/s, "
+	            "rate %ju -> %ju B/s (0 = unlimited)\n", pressure, inflight,
+	            (uintmax_t) measured, (uintmax_t) t->rate, (uintmax_t) rate);
+	}
+	t->rate = rate;
+	t->last_check_us = now;
+	t->bytes_since_check = 0;
+	t->slept_since_check = false;
+}
+
+/* Waits until len more bytes may be written. */
+void throttle_write(struct Throttle *t, size_t len, struct Stats *stats) {
+	uint64_t now = now_us();
+	if ((now - t->last_check_us) >= THROTTLE_INTERVAL_US) {
+	    throttle_adjust(t, now, stats);
+	}
+	t->bytes_since_check += len;
+	if (t->rate == 0) {
+	    t->next_write_us = now;
+	    return;
+	}
+	if (t->next_write_us > now) {
+	    uint64_t wait_us = t->next_write_us - now;
+	    struct timespec ts = { .tv_sec = wait_us / 1000000, .tv_nsec = (wait_us % 1000000) * 1000 };
+	    while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR)) {
+	        continue;
+	    }
+	    stats->throttle_sleep_us += wait_us;
+	    t->slept_since_check = true;
+	    now = t->next_write_us;
+	}
+	t->next_write_us = now + (uint64_t) len * 1000000 / t->rate;
+}
+
+/* BLOCK_SIZE buffers for the input buffering, allocated on demand and kept
+ * for reuse as long as there are no more of them than the limit. */
+struct BufPool {
+	pthread_mutex_t lock;
+	unsigned char **free_bufs;
+	size_t n_free;
+	size_t n_allocated;
+	size_t limit;
+	size_t capacity;              /* max limit */
+};
+
+bool bufpool_init(struct BufPool *pool, size_t capacity) {
+	pool->free_bufs = calloc(capacity, sizeof(unsigned char *));
+	if (pool->free_bufs == NULL) {
+	    return false;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->n_free = 0;
+	pool->n_allocated = 0;
+	pool->limit = capacity;
+	pool->capacity = capacity;
+	return true;
+}
+
+void bufpool_destroy(struct BufPool *pool) {
+	for (size_t i = 0; i < pool->n_free; i++) {
+	    free(pool->free_bufs[i]);
+	}
+	free(pool->free_bufs);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+unsigned char *bufpool_get(struct BufPool *pool) {
+	unsigned char *buf = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n_free > 0) {
+	    buf = pool->free_bufs[--pool->n_free];
+	} else {
+	    buf = malloc(BLOCK_SIZE);
+	    if (buf != NULL) {
+	        pool->n_allocated++;
+	    }
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return buf;
+}
+
+void bufpool_put(struct BufPool *pool, unsigned char *buf) {
+	pthread_mutex_lock(&pool->lock);
+	if ((pool->n_allocated > pool->limit) || (pool->n_free == pool->capacity)) {
+	    free(buf);
+	    pool->n_allocated--;
+	} else {
+	    pool->free_bufs[pool->n_free++] = buf;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Buffers in use above the new limit are freed once they are put back. */
+void bufpool_set_limit(struct BufPool *pool, size_t limit) {
+	pthread_mutex_lock(&pool->lock);
+	pool->limit = MIN(limit, pool->capacity);
+	while ((pool->n_allocated > pool->limit) && (pool->n_free > 0)) {
+	    free(pool->free_bufs[--pool->n_free]);
+	    pool->n_allocated--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/***
+    Single-producer/single-consumer ring of BLOCK_SIZE buffers decoupling the
+    input from the target. A dedicated thread drains the input into the ring
+    so that the upstream writer (e.g. a downloader piping data to us) is not
+    blocked while we are stuck in write() or fsync() on a slow device.
+
+    The head and tail counters are only ever written by one side each, so no
+    locking is needed. Futexes are only used to sleep when the ring is full
+    (producer) or empty (consumer), and only woken when the other side
+    announced it is sleeping. The producer sleeps on its own wake counter,
+    bumped by everything that may let it continue, including ring_destroy().
+    While reading, it also polls a pipe that ring_destroy() writes to, so it
+    can be stopped even if the input never delivers anything again.
+
+    The buffers come from a pool and are given back once consumed, so that
+    the ring only holds as many as its current limit allows.
+***/
+struct RingSlot {
+	unsigned char *buf;
+	ssize_t len;
+	int error;
+};
+
+struct Ring {
+	struct RingSlot *slots;
+	uint32_t n_slots;             /* power of 2 */
+	_Atomic uint32_t limit;       /* slots to fill at most, <= n_slots */
+	struct BufPool pool;
+	_Atomic uint32_t head;        /* next slot to fill (producer) */
+	_Atomic uint32_t tail;        /* next slot to consume (consumer) */
+	_Atomic bool producer_waiting;
+	_Atomic bool consumer_waiting;
+	_Atomic uint32_t producer_wake;   /* bumped before waking the producer */
+	_Atomic bool stop;
+	int stop_pipe[2];
+	int in_fd;
+	size_t len;
+	pthread_t thread;
+	bool thread_running;
+	uint32_t high_water;          /* max number of filled slots (producer) */
+	size_t stalls;                /* times the producer found the ring full */
+};
+
+static void ring_futex_wait(_Atomic uint32_t *word, uint32_t old) {
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, old, NULL, NULL, 0);
+#else
+	(void) word;
+	(void) old;
+	sched_yield();
+#endif  /* __linux__ */
+}
+
+static void ring_futex_wake(_Atomic uint32_t *word) {
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+	(void) word;
+#endif  /* __linux__ */
+}
+
+static void ring_wake_producer(struct Ring *ring) {
+	atomic_fetch_add(&ring->producer_wake, 1);
+	if (atomic_load(&ring->producer_waiting)) {
+	    ring_futex_wake(&ring->producer_wake);
+	}
+}
+
+/* Like buf_io(read), but gives up with ECANCELED once the ring is stopped. */
+static ssize_t ring_read(struct Ring *ring, unsigned char *buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+	    struct pollfd fds[2] = {
+	        { .fd = ring->in_fd, .events = POLLIN },
+	        { .fd = ring->stop_pipe[0], .events = POLLIN },
+	    };
+	    int ret = poll(fds, 2, -1);
+	    if ((ret == -1) && (errno == EINTR)) {
+	        continue;
+	    } else if (ret == -1) {
+	        return -1;
+	    } else if (fds[1].revents != 0) {
+	        errno = ECANCELED;
+	        return -1;
+	    }
+	    ssize_t n_read = read(ring->in_fd, buf + done, len - done);
+	    if ((n_read == -1) && ((errno == EINTR) || (errno == EAGAIN))) {
+	        continue;
+	    } else if (n_read == -1) {
+	        return -1;
+	    } else if (n_read == 0) {
+	        break;
+	    }
+	    done += n_read;
+	}
+	return done;
+}
+
+static void *ring_producer(void *arg) {
+	struct Ring *ring = arg;
+	size_t rem = ring->len;
+	bool done = false;
+	while (!done && !atomic_load(&ring->stop)) {
+	    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	    uint32_t tail = atomic_load(&ring->tail);
+	    if ((head - tail) >= atomic_load(&ring->limit)) {
+	        ring->stalls++;
+	        atomic_store(&ring->producer_waiting, true);
+	        while (true) {
+	            uint32_t wake = atomic_load(&ring->producer_wake);
+	            if (((head - atomic_load(&ring->tail)) < atomic_load(&ring->limit)) ||
+	                atomic_load(&ring->stop)) {
+	                break;
 	            }
+	            ring_futex_wait(&ring->producer_wake, wake);
 	        }
+	        atomic_store(&ring->producer_waiting, false);
+	        continue;
+	    }
+
+	    struct RingSlot *slot = &ring->slots[head & (ring->n_slots - 1)];
+	    slot->buf = bufpool_get(&ring->pool);
+	    if (slot->buf == NULL) {
+	        slot->len = -1;
+	        slot->error = ENOMEM;
+	    } else {
+	        slot->len = ring_read(ring, slot->buf, MIN(BLOCK_SIZE, rem));
+	        slot->error = errno;
+	    }
+	    if (slot->len > 0) {
+	        rem -= slot->len;
+	    }
+	    done = ((slot->len <= 0) || (rem == 0));
+
+	    if ((head + 1 - tail) > ring->high_water) {
+	        ring->high_water = head + 1 - tail;
+	    }
+	    atomic_store(&ring->head, head + 1);
+	    if (atomic_load(&ring->consumer_waiting)) {
+	        ring_futex_wake(&ring->head);
+	    }
+	}
+	return NULL;
+}
+
+void ring_destroy(struct Ring *ring) {
+	if (ring->thread_running) {
+	    atomic_store(&ring->stop, true);
+	    ring_wake_producer(ring);
+	    /* for a producer waiting for more input */
+	    char byte = 0;
+	    while ((write(ring->stop_pipe[1], &byte, 1) == -1) && (errno == EINTR)) {
+	        continue;
+	    }
+	    pthread_join(ring->thread, NULL);
+	}
+	if (ring->stop_pipe[0] != -1) {
+	    close(ring->stop_pipe[0]);
+	    close(ring->stop_pipe[1]);
+	}
+	for (uint32_t i = 0; i < ring->n_slots; i++) {
+	    free(ring->slots[i].buf);
+	}
+	free(ring->slots);
+	bufpool_destroy(&ring->pool);
+	free(ring);
+}
+
+/* Sets how much of the ring (in bytes) may be filled, at least 1 slot. */
+void ring_set_limit(struct Ring *ring, size_t mem_use) {
+	uint32_t limit = MIN(MAX(mem_use / BLOCK_SIZE, 1), ring->n_slots);
+	bufpool_set_limit(&ring->pool, limit);
+	atomic_store(&ring->limit, limit);
+	ring_wake_producer(ring);
+}
+
+#ifdef __linux__
+/* Filesystems where every read() is a round trip to some server. */
+bool on_network_fs(int fd) {
+	struct statfs fs;
+	if (fstatfs(fd, &fs) == -1) {
+	    return false;
+	}
+	switch ((unsigned long) fs.f_type) {
+	case 0x6969:        /* NFS */
+	case 0x65735546:    /* FUSE */
+	case 0xFF534D42:    /* CIFS */
+	case 0xFE534D42:    /* SMB2 */
+	case 0x01021997:    /* 9P */
+	case 0x00C36400:    /* Ceph */
+	    return true;
+	default:
+	    return false;
+	}
+}
+#endif  /* __linux__ */
+
+/* Creates a ring for at most mem_cap bytes, initially using at most mem_use
+ * bytes (see ring_set_limit()). */
+struct Ring *ring_create(int in_fd, size_t len, size_t mem_cap, size_t mem_use) {
+	uint32_t n_slots = 1;
+	while ((n_slots * 2 * BLOCK_SIZE) <= mem_cap) {
+	    n_slots *= 2;
+	}
+
+	struct Ring *ring = calloc(1, sizeof(struct Ring));
+	if (ring == NULL) {
+	    return NULL;
+	}
+	ring->slots = calloc(n_slots, sizeof(struct RingSlot));
+	if (ring->slots == NULL) {
+	    free(ring);
+	    return NULL;
+	}
+	if (!bufpool_init(&ring->pool, n_slots)) {
+	    free(ring->slots);
+	    free(ring);
+	    return NULL;
+	}
+	ring->n_slots = n_slots;
+	ring->in_fd = in_fd;
+	ring->len = len;
+	ring->stop_pipe[0] = -1;
+	ring_set_limit(ring, mem_use);
+	if (pipe(ring->stop_pipe) == -1) {
+	    ring->stop_pipe[0] = -1;
+	    ring_destroy(ring);
+	    return NULL;
+	}
+
+	int ret = pthread_create(&ring->thread, NULL, ring_producer, ring);
+	if (ret != 0) {
+	    errno = ret;
+	    ring_destroy(ring);
+	    return NULL;
+	}
+	ring->thread_running = true;
+	return ring;
+}
+
+/* Gets the next chunk of input from the ring, blocking if there is none yet. The
+ * returned data stay valid until the matching ring_release() call. */
+ssize_t ring_get(struct Ring *ring, unsigned char **data) {
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load(&ring->head);
+	if (head == tail) {
+	    atomic_store(&ring->consumer_waiting, true);
+	    while ((head = atomic_load(&ring->head)) == tail) {
+	        ring_futex_wait(&ring->head, head);
+	    }
+	    atomic_store(&ring->consumer_waiting, false);
+	}
+
+	struct RingSlot *slot = &ring->slots[tail & (ring->n_slots - 1)];
+	*data = slot->buf;
+	errno = slot->error;
+	return slot->len;
+}
+
+void ring_release(struct Ring *ring) {
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	struct RingSlot *slot = &ring->slots[tail & (ring->n_slots - 1)];
+	if (slot->buf != NULL) {
+	    bufpool_put(&ring->pool, slot->buf);
+	    slot->buf = NULL;
+	}
+	atomic_fetch_add(&ring->tail, 1);
+	ring_wake_producer(ring);
+}
+
+/***
+    Read-ahead for seekable inputs on high-latency filesystems (FUSE, NFS,
+    ...) where every read() is a round trip. Several worker threads keep
+    positional reads in flight, each into one or more consecutive BLOCK_SIZE
+    slots, and the results are handed over to the consumer in order. Whenever
+    the consumer has to wait for data while the reads are slow, the number of
+    reads in flight is increased and, once all the workers are busy, their
+    size too. Like in the ring, the buffers come from a pool and only up to
+    the current limit of them are used.
+***/
+struct ReadAheadSlot {
+	unsigned char *buf;
+	ssize_t len;
+	int error;
+	bool ready;
+};
+
+struct ReadAhead {
+	struct ReadAheadSlot *slots;
+	size_t n_slots;
+	size_t limit;                 /* slots to fill at most, <= n_slots */
+	struct BufPool pool;
+	int in_fd;
+	off_t start;
+	size_t len;
+	pthread_mutex_t lock;
+	pthread_cond_t slot_ready;    /* consumer waits for the next slot */
+	pthread_cond_t slot_free;     /* workers wait for free slots */
+	pthread_t workers[READAHEAD_MAX_WORKERS];
+	size_t n_workers;
+	bool stop;
+	/* sequence numbers of BLOCK_SIZE chunks of the input */
+	size_t next_claim;
+	size_t next_consume;
+	size_t n_chunks;
+	/* adaptive parameters */
+	size_t max_inflight;          /* reads in flight at most */
+	size_t read_blocks;           /* BLOCK_SIZE chunks per read */
+	size_t n_inflight;
+	uint64_t latency_ewma_us;
+	/* statistics */
+	size_t peak_inflight;
+	size_t peak_read_blocks;
+	size_t consumer_waits;
+};
+
+static void *readahead_worker(void *arg) {
+	struct ReadAhead *ra = arg;
+	pthread_mutex_lock(&ra->lock);
+	while (!ra->stop && (ra->next_claim < ra->n_chunks)) {
+	    size_t n_blocks = MIN(MIN(ra->read_blocks, ra->limit), ra->n_chunks - ra->next_claim);
+	    if ((ra->n_inflight >= ra->max_inflight) ||
+	        ((ra->next_claim + n_blocks - ra->next_consume) > ra->limit)) {
+	        pthread_cond_wait(&ra->slot_free, &ra->lock);
+	        continue;
+	    }
+	    size_t first = ra->next_claim;
+	    ra->next_claim += n_blocks;
+	    ra->n_inflight++;
+	    pthread_mutex_unlock(&ra->lock);
+
+	    struct iovec iov[READAHEAD_MAX_READ_BLOCKS];
+	    size_t total = 0;
+	    bool have_bufs = true;
+	    for (size_t i = 0; i < n_blocks; i++) {
+	        unsigned char *buf = bufpool_get(&ra->pool);
+	        have_bufs = have_bufs && (buf != NULL);
+	        ra->slots[(first + i) % ra->n_slots].buf = buf;
+	        iov[i].iov_base = buf;
+	        iov[i].iov_len = MIN(BLOCK_SIZE, ra->len - (first + i) * BLOCK_SIZE);
+	        total += iov[i].iov_len;
+	    }
+	    off_t offset = ra->start + first * BLOCK_SIZE;
+	    uint64_t start = now_us();
+	    ssize_t ret = -1;
+	    errno = ENOMEM;
+	    while (have_bufs) {
+	        ret = preadv(ra->in_fd, iov, n_blocks, offset);
+	        if ((ret != -1) || (errno != EINTR)) {
+	            break;
+	        }
+	    }
+	    uint64_t latency = now_us() - start;
+	    int error = errno;
+
+	    /* Short reads are possible on network filesystems, finish the
+	       individual blocks the usual way. */
+	    size_t done = (ret > 0) ? ret : 0;
+	    for (size_t i = 0; i < n_blocks; i++) {
+	        struct ReadAheadSlot *slot = &ra->slots[(first + i) % ra->n_slots];
+	        size_t have = MIN(done, iov[i].iov_len);
+	        done -= have;
+	        slot->len = have;
+	        slot->error = error;
+	        if ((ret == -1) && (have == 0)) {
+	            slot->len = -1;
+	        } else if ((ret > 0) && (have < iov[i].iov_len)) {
+	            ssize_t rest = buf_pio((pio_fn_t)pread, ra->in_fd, slot->buf + have,
+	                                   iov[i].iov_len - have,
+	                                   offset + i * BLOCK_SIZE + have);
+	            slot->error = errno;
+	            slot->len = (rest < 0) ? -1 : (ssize_t) (have + rest);
+	        }
+	    }
+
+	    pthread_mutex_lock(&ra->lock);
+	    ra->latency_ewma_us = (ra->latency_ewma_us == 0) ? latency :
+	        (ra->latency_ewma_us * 7 + latency) / 8;
+	    for (size_t i = 0; i < n_blocks; i++) {
+	        ra->slots[(first + i) % ra->n_slots].ready = true;
+	    }
+	    ra->n_inflight--;
+	    pthread_cond_signal(&ra->slot_ready);
+	    pthread_cond_broadcast(&ra->slot_free);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+void readahead_destroy(struct ReadAhead *ra) {
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = true;
+	pthread_cond_broadcast(&ra->slot_free);
+	pthread_mutex_unlock(&ra->lock);
+	for (size_t i = 0; i < ra->n_workers; i++) {
+	    pthread_join(ra->workers[i], NULL);
+	}
+	for (size_t i = 0; i < ra->n_slots; i++) {
+	    free(ra->slots[i].buf);
+	}
+	free(ra->slots);
+	bufpool_destroy(&ra->pool);
+	pthread_cond_destroy(&ra->slot_free);
+	pthread_cond_destroy(&ra->slot_ready);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra);
+}
+
+/* Sets how much of the read-ahead buffers (in bytes) may be filled, at least 2
+ * slots. */
+void readahead_set_limit(struct ReadAhead *ra, size_t mem_use) {
+	pthread_mutex_lock(&ra->lock);
+	ra->limit = MIN(MAX(mem_use / BLOCK_SIZE, 2), ra->n_slots);
+	bufpool_set_limit(&ra->pool, ra->limit);
+	pthread_cond_broadcast(&ra->slot_free);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+/* Creates read-ahead for at most mem_cap bytes, initially using at most
+ * mem_use bytes (see readahead_set_limit()). */
+struct ReadAhead *readahead_create(int in_fd, size_t len, size_t mem_cap, size_t mem_use) {
+	off_t start = lseek(in_fd, 0, SEEK_CUR);
+	if (start == -1) {
+	    return NULL;
+	}
+	struct ReadAhead *ra = calloc(1, sizeof(struct ReadAhead));
+	if (ra == NULL) {
+	    return NULL;
+	}
+	ra->n_slots = (mem_cap / BLOCK_SIZE < 2) ? 2 : mem_cap / BLOCK_SIZE;
+	ra->slots = calloc(ra->n_slots, sizeof(struct ReadAheadSlot));
+	if (ra->slots == NULL) {
+	    free(ra);
+	    return NULL;
+	}
+	if (!bufpool_init(&ra->pool, ra->n_slots)) {
+	    free(ra->slots);
+	    free(ra);
+	    return NULL;
+	}
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->slot_ready, NULL);
+	pthread_cond_init(&ra->slot_free, NULL);
+	ra->in_fd = in_fd;
+	ra->start = start;
+	ra->len = len;
+	ra->n_chunks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	ra->max_inflight = 2;
+	ra->read_blocks = 1;
+	ra->peak_inflight = ra->max_inflight;
+	ra->peak_read_blocks = ra->read_blocks;
+	readahead_set_limit(ra, mem_use);
+
+	size_t n_workers = MIN(READAHEAD_MAX_WORKERS, ra->n_slots);
+	for (size_t i = 0; i < n_workers; i++) {
+	    int ret = pthread_create(&ra->workers[i], NULL, readahead_worker, ra);
+	    if (ret != 0) {
+	        if (ra->n_workers == 0) {
+	            errno = ret;
+	            readahead_destroy(ra);
+	            return NULL;
+	        }
+	        break;
+	    }
+	    ra->n_workers++;
+	}
+	return ra;
+}
+
+/* Makes the reads more aggressive if the consumer had to wait for data which
+ * isn't coming quickly enough. Called with the lock held. */
+static void readahead_adapt(struct ReadAhead *ra) {
+	if (ra->latency_ewma_us < READAHEAD_LOW_LATENCY_US) {
+	    return;
+	}
+	if (ra->max_inflight < ra->n_workers) {
+	    ra->max_inflight++;
+	} else if (((ra->read_blocks * 2) <= READAHEAD_MAX_READ_BLOCKS) &&
+	           ((ra->max_inflight * ra->read_blocks * 2) <= ra->limit)) {
+	    ra->read_blocks *= 2;
+	} else {
+	    return;
+	}
+	if (ra->max_inflight > ra->peak_inflight) {
+	    ra->peak_inflight = ra->max_inflight;
+	}
+	if (ra->read_blocks > ra->peak_read_blocks) {
+	    ra->peak_read_blocks = ra->read_blocks;
+	}
+	pthread_cond_broadcast(&ra->slot_free);
+}
+
+/* Gets the next chunk of input, in order, blocking until it is read. The
+ * returned data stay valid until the matching readahead_release() call. */
+ssize_t readahead_get(struct ReadAhead *ra, unsigned char **data) {
+	if (ra->next_consume >= ra->n_chunks) {
+	    return 0;
+	}
+	struct ReadAheadSlot *slot = &ra->slots[ra->next_consume % ra->n_slots];
+	pthread_mutex_lock(&ra->lock);
+	if (!slot->ready) {
+	    ra->consumer_waits++;
+	    readahead_adapt(ra);
+	    while (!slot->ready) {
+	        pthread_cond_wait(&ra->slot_ready, &ra->lock);
+	    }
+	}
+	pthread_mutex_unlock(&ra->lock);
+	*data = slot->buf;
+	errno = slot->error;
+	return slot->len;
+}
+
+void readahead_release(struct ReadAhead *ra) {
+	pthread_mutex_lock(&ra->lock);
+	struct ReadAheadSlot *slot = &ra->slots[ra->next_consume % ra->n_slots];
+	if (slot->buf != NULL) {
+	    bufpool_put(&ra->pool, slot->buf);
+	    slot->buf = NULL;
+	}
+	slot->ready = false;
+	ra->next_consume++;
+	pthread_cond_broadcast(&ra->slot_free);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+/***
+    Resumable flashing. At every durability checkpoint (successful fsync()) we
+    save the synced offset, together with the intermediate state of the hash
+    of the data written so far, into a small text file. The file is replaced
+    atomically so that it always describes data that is on the target. After
+    a restart, both writing and hashing continue from there.
+***/
+#define CHECKPOINT_MAGIC "mender-flash-checkpoint 1"
+
+struct Checkpoint {
+	const char *path;
+	uint64_t len;
+	bool have_expected;
+	unsigned char expected[SHA256_DIGEST_SIZE];
+};
+
+bool checkpoint_save(const struct Checkpoint *cp, off_t offset, const struct Sha256 *hash) {
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cp->path) >= (int) sizeof(tmp_path)) {
+	    errno = ENAMETOOLONG;
+	    return false;
+	}
+	FILE *f = fopen(tmp_path, "w");
+	if (f == NULL) {
+	    return false;
+	}
+
+	char expected_hex[SHA256_HEX_SIZE] = "-";
+	if (cp->have_expected) {
+	    sha256_to_hex(cp->expected, expected_hex);
+	}
+	char state[SHA256_STATE_SIZE] = "-";
+	if (hash != NULL) {
+	    sha256_save(hash, state);
+	}
+	fprintf(f, CHECKPOINT_MAGIC "\nlength %ju\nexpect %s\noffset %jd\nsha256 %s\n",
+	        (uintmax_t) cp->len, expected_hex, (intmax_t) offset, state);
+
+	bool ok = ((fflush(f) == 0) && (fsync(fileno(f)) == 0));
+	ok = (fclose(f) == 0) && ok;
+	if (ok) {
+	    ok = (rename(tmp_path, cp->path) == 0);
+	}
+	if (!ok) {
+	    int saved_errno = errno;
+	    unlink(tmp_path);
+	    errno = saved_errno;
+	}
+	return ok;
+}
+
+/* Loads the offset (and hash state if hash is not NULL) from an existing
+ * checkpoint. Returns false if there is no usable checkpoint for this run. */
+bool checkpoint_load(const struct Checkpoint *cp, off_t *offset, struct Sha256 *hash) {
+	FILE *f = fopen(cp->path, "r");
+	if (f == NULL) {
+	    return false;
+	}
+
+	char magic[64];
+	uintmax_t len;
+	char expected_hex[SHA256_HEX_SIZE];
+	intmax_t saved_offset;
+	char state[SHA256_STATE_SIZE];
+	bool ok = ((fgets(magic, sizeof(magic), f) != NULL) &&
+	           (strcmp(magic, CHECKPOINT_MAGIC "\n") == 0) &&
+	           (fscanf(f, "length %ju\n", &len) == 1) &&
+	           (fscanf(f, "expect %64s\n", expected_hex) == 1) &&
+	           (fscanf(f, "offset %jd\n", &saved_offset) == 1) &&
+	           (fscanf(f, "sha256 %221[^\n]\n", state) == 1));
+	fclose(f);
+	if (!ok) {
+	    fprintf(stderr, "warning: Ignoring invalid checkpoint '%s'\n", cp->path);
+	    return false;
+	}
+
+	unsigned char expected[SHA256_DIGEST_SIZE];
+	bool have_expected = sha256_from_hex(expected_hex, expected);
+	if ((len != cp->len) || (have_expected != cp->have_expected) ||
+	    (have_expected && (memcmp(expected, cp->expected, SHA256_DIGEST_SIZE) != 0))) {
+	    fprintf(stderr, "warning: Ignoring checkpoint '%s' of a different image\n", cp->path);
+	    return false;
+	}
+	if ((saved_offset < 0) || ((uintmax_t) saved_offset > len)) {
+	    fprintf(stderr, "warning: Ignoring invalid checkpoint '%s'\n", cp->path);
+	    return false;
+	}
+	if (hash != NULL) {
+	    if (!sha256_load(hash, state) || (hash->n_bytes != (uint64_t) saved_offset)) {
+	        fprintf(stderr, "warning: Ignoring checkpoint '%s' without hash state\n", cp->path);
+	        return false;
+	    }
+	}
+
+	*offset = saved_offset;
+	return true;
+}
+
+/* Without a hash of the image, the checkpoint only matches on the length. So
+ * the input up to offset is compared with the target before resuming, which
+ * needs seekable input (in_fd is -1 otherwise). Returns false if the checkpoint
+ * cannot be trusted. */
+bool checkpoint_verify(const struct Checkpoint *cp, int in_fd, int out_fd, off_t offset) {
+	if (in_fd == -1) {
+	    fprintf(stderr, "warning: Ignoring checkpoint '%s', resuming non-seekable input"
+	            " requires --expect-sha256\n", cp->path);
+	    return false;
+	}
+	off_t in_base = lseek(in_fd, 0, SEEK_CUR);
+	bool same = (in_base != -1);
+	unsigned char in_buf[BLOCK_SIZE];
+	unsigned char out_buf[BLOCK_SIZE];
+	for (off_t pos = 0; same && (pos < offset); pos += BLOCK_SIZE) {
+	    size_t n = MIN(BLOCK_SIZE, offset - pos);
+	    same = ((buf_pio((pio_fn_t)pread, in_fd, in_buf, n, in_base + pos) == (ssize_t) n) &&
+	            (buf_pio((pio_fn_t)pread, out_fd, out_buf, n, pos) == (ssize_t) n) &&
+	            (memcmp(in_buf, out_buf, n) == 0));
+	}
+	if (!same) {
+	    fprintf(stderr, "warning: Ignoring checkpoint '%s', the target doesn't match the input\n",
+	            cp->path);
+	}
+	return same;
+}
+
+struct ShovelOptions {
+	bool write_optimized;
+	size_t fsync_interval;
+	size_t erase_size;
+	struct Ring *ring;
+	struct ReadAhead *readahead;
+	struct Sha256 *hash;
+	struct Checkpoint *checkpoint;
+	const struct Index *index;
+	const bool *planned;        /* blocks known to be on the target already */
+	uint32_t *block_crcs;       /* for verifying non-seekable input later */
+	size_t batch_size;          /* window for shovel_batched(), 0 to disable */
+	struct Throttle *throttle;
+	bool adapt_memory;
+	bool fixed_fsync_interval;  /* given with -f, not to be adapted */
+	size_t ring_size;           /* configured limits for the input buffers */
+	size_t readahead_size;
+};
+
+void mem_account(struct Stats *stats, unsigned int pct) {
+	if (!stats->mem_adapted || (pct < stats->mem_pct_low)) {
+	    stats->mem_pct_low = pct;
+	}
+	if (stats->mem_adapted && (pct < stats->mem_pct)) {
+	    stats->mem_trims++;
+	}
+	stats->mem_pct = pct;
+	stats->mem_adapted = true;
+}
+
+/* Resizes the input buffers according to the current memory budget and returns
+ * the write-behind window (bytes written between fsyncs) to use. */
+size_t mem_adapt(const struct ShovelOptions *opts, struct Stats *stats) {
+	struct MemState ms;
+	if (!mem_state_read(&ms)) {
+	    return opts->fsync_interval;
+	}
+	size_t ring_size = (opts->ring != NULL) ? opts->ring_size : 0;
+	size_t readahead_size = (opts->readahead != NULL) ? opts->readahead_size : 0;
+	unsigned int pct = mem_scale(&ms, ring_size + readahead_size + opts->fsync_interval);
+	mem_account(stats, pct);
+	if (opts->ring != NULL) {
+	    ring_set_limit(opts->ring, mem_scaled(ring_size, pct, 2 * BLOCK_SIZE));
+	}
+	if (opts->readahead != NULL) {
+	    readahead_set_limit(opts->readahead, mem_scaled(readahead_size, pct, 2 * BLOCK_SIZE));
+	}
+	if (opts->fixed_fsync_interval) {
+	    return opts->fsync_interval;
+	}
+	return mem_scaled(opts->fsync_interval, pct, BLOCK_SIZE);
+}
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t len);
+
+/* Compares the target with the index, starting at the given block, before any
+ * input arrives. Returns which blocks already have the right contents or NULL
+ * in case of error. */
+bool *index_plan(const struct Index *index, int out_fd, uint64_t first_block,
+                 struct Stats *stats) {
+	bool *planned = calloc(index->n_blocks, sizeof(bool));
+	unsigned char *buf = malloc(index->block_size);
+	if ((planned == NULL) || (buf == NULL)) {
+	    free(planned);
+	    free(buf);
+	    return NULL;
+	}
+	for (uint64_t i = first_block; i < index->n_blocks; i++) {
+	    size_t len = index_block_len(index, i);
+	    ssize_t n_read = buf_pio((pio_fn_t)pread, out_fd, buf, len, i * index->block_size);
+	    if (n_read < 0) {
+	        free(planned);
+	        free(buf);
+	        return NULL;
+	    }
+	    if (n_read == 0) {
+	        /* the target is shorter than the image */
+	        break;
+	    }
+	    planned[i] = index_block_matches(index, i, buf, n_read);
+	    if (planned[i]) {
+	        stats->blocks_planned++;
+	    }
+	}
+	free(buf);
+	return planned;
+}
+
+/* Makes sure everything written so far is on the target and records that in
+ * the checkpoint, if any. */
+void sync_target(int out_fd, off_t offset, const struct ShovelOptions *opts,
+                 struct Stats *stats) {
+	if (timed_fsync(out_fd, stats) == -1) {
+	    fprintf(stderr, "warning: Failed to fsync data to target: %m\n");
+	    return;
+	}
+	if ((opts->checkpoint != NULL) && !checkpoint_save(opts->checkpoint, offset, opts->hash)) {
+	    fprintf(stderr, "warning: Failed to save checkpoint: %m\n");
+	}
+}
+
+/* Gets the next (at most BLOCK_SIZE long) chunk of input, either read into buffer
+ * or from the ring or read-ahead buffers. Must be followed by input_release(). */
+ssize_t input_get(int in_fd, const struct ShovelOptions *opts, unsigned char *buffer,
+                  size_t len, unsigned char **data) {
+	*data = buffer;
+	if (opts->ring != NULL) {
+	    return ring_get(opts->ring, data);
+	} else if (opts->readahead != NULL) {
+	    return readahead_get(opts->readahead, data);
+	} else {
+	    return buf_io((io_fn_t)read, in_fd, buffer, MIN(BLOCK_SIZE, len));
+	}
+}
+
+void input_release(const struct ShovelOptions *opts) {
+	if (opts->ring != NULL) {
+	    ring_release(opts->ring);
+	} else if (opts->readahead != NULL) {
+	    readahead_release(opts->readahead);
+	}
+}
+
+/* Hashes, verifies and records the given chunk of input at offset, as far as
+ * requested in opts. */
+bool input_check(const struct ShovelOptions *opts, off_t offset, const unsigned char *data,
+                 size_t len, struct Stats *stats) {
+	if (opts->hash != NULL) {
+	    sha256_update(opts->hash, data, len);
+	}
+	uint64_t block = offset / BLOCK_SIZE;
+	if (opts->index != NULL) {
+	    if ((offset % BLOCK_SIZE != 0) ||
+	        !index_block_matches(opts->index, block, data, len)) {
+	        fprintf(stderr, "Input does not match the index at offset %jd\n", (intmax_t) offset);
+	        return false;
+	    }
+	    stats->blocks_verified++;
+	}
+	if (opts->block_crcs != NULL) {
+	    opts->block_crcs[block] = crc32_update(0, data, len);
+	}
+	return true;
+}
+
+/* Appends the next chunk of input (at most BLOCK_SIZE, of the len bytes
+ * remaining) to buf and checks it with input_check() as being at offset.
+ * Returns the number of bytes appended or -1 (with *error set on I/O errors). */
+static ssize_t input_append(int in_fd, const struct ShovelOptions *opts, unsigned char *buf,
+                            size_t len, off_t offset, struct Stats *stats, int *error) {
+	unsigned char *chunk;
+	ssize_t n_read = input_get(in_fd, opts, buf, len, &chunk);
+	if (n_read < 0) {
+	    fprintf(stderr, "Failed to read data: %m\n");
+	    *error = errno;
+	} else if (n_read == 0) {
+	    fprintf(stderr, "Unexpected end of input!\n");
+	    n_read = -1;
+	} else {
+	    if (chunk != buf) {
+	        memcpy(buf, chunk, n_read);
+	    }
+	    if (!input_check(opts, offset, buf, n_read, stats)) {
+	        n_read = -1;
+	    }
+	}
+	input_release(opts);
+	return n_read;
+}
+
+bool shovel_data(int in_fd, int out_fd, size_t len, const struct ShovelOptions *opts,
+	             struct Stats *stats, int *error) {
+	unsigned char buffer[BLOCK_SIZE];
+	struct WearState wear = { 0 };
+	size_t n_unsynced = 0;
+	size_t sync_window = opts->fsync_interval;
+	uint64_t next_mem_check = 0;
+	off_t offset = lseek(out_fd, 0, SEEK_CUR);
+	if (offset == -1) {
+	    fprintf(stderr, "Failed to seek on the target: %m\n");
+	    *error = errno;
+	    return false;
+	}
+	while (len > 0) {
+	    stats_shm_publish(stats);
+	    if (opts->adapt_memory && (now_us() >= next_mem_check)) {
+	        sync_window = mem_adapt(opts, stats);
+	        next_mem_check = now_us() + MEM_CHECK_INTERVAL_US;
+	    }
+	    unsigned char *data;
+	    perf_phase(PHASE_INPUT);
+	    ssize_t n_read = input_get(in_fd, opts, buffer, len, &data);
+	    if (n_read < 0) {
+	        fprintf(stderr, "Failed to read data: %m\n");
+	        *error = errno;
+	        return false;
+	    }
+	    if ((n_read == 0) && (len > 0)) {
+	        fprintf(stderr, "Unexpected end of input!\n");
+	        return false;
+	    }
+	    if (!input_check(opts, offset, data, n_read, stats)) {
+	        return false;
+	    }
+	    uint64_t block = offset / BLOCK_SIZE;
+	    bool omit = false;
+	    if (opts->write_optimized) {
+	        unsigned char out_fd_buffer[BLOCK_SIZE];
+	        perf_phase(PHASE_COMPARE);
+	        size_t n_target;
+	        int same;
+	        if ((opts->planned != NULL) && (opts->planned[block] || (opts->erase_size == 0))) {
+	            /* the input matches the index, so the plan holds */
+	            same = opts->planned[block] ? 1 : 0;
+	        } else {
+	            same = compare_target(out_fd, offset, data, n_read, out_fd_buffer,
+	                                  (opts->erase_size != 0), &n_target, stats);
+	            if (same < 0) {
+	                fprintf(stderr, "Failed to read data from the target: %m\n");
+	                *error = errno;
+	                return false;
+	            }
+	            if ((same == 0) && (opts->erase_size != 0)) {
+	                account_wear(stats, &wear, opts->erase_size, offset, data, n_read, out_fd_buffer,
+	                             n_target);
+	            }
+	        }
+	        if (same == 1) {
+	            if (lseek(out_fd, n_read, SEEK_CUR) == -1) {
+	                fprintf(stderr, "Failed to seek on the target: %m\n");
+	                *error = errno;
+	                return false;
+	            }
+	            omit = true;
+	        }
+	    }
+	    if (omit) {
+	        stats->blocks_omitted++;
+	        stats->total_bytes += n_read;
+	        len -= n_read;
+	        offset += n_read;
+	        input_release(opts);
+	        continue;
+	    }
+	    perf_phase(PHASE_WRITE);
+	    if (opts->throttle != NULL) {
+	        throttle_write(opts->throttle, n_read, stats);
+	    }
+	    ssize_t n_written = buf_io((io_fn_t)write, out_fd, data, n_read);
+	    if (n_written != n_read) {
+	        fprintf(stderr, "Failed to write data: %m\n");
+	        *error = errno;
+	        return false;
+	    }
+	    input_release(opts);
+		stats->total_bytes += n_read;
+	    stats->blocks_written++;
+	    stats->bytes_written += n_written;
+	    len -= n_read;
+	    offset += n_read;
+		if (opts->fsync_interval != 0) {
+			n_unsynced += n_written;
+			if (n_unsynced >= sync_window) {
+				sync_target(out_fd, offset, opts, stats);
+				n_unsynced = 0;
+			}
+		}
+	}
+
+	if ((opts->fsync_interval != 0) && (n_unsynced > 0)) {
+		sync_target(out_fd, offset, opts, stats);
+	}
+	return true;
+}
+
+/***
+    Batched compare (--batch-size). Instead of one target read per BLOCK_SIZE
+    chunk of input, a whole window of input is collected first, the target is
+    read for the whole window at once and compared in parallel slices, and
+    the differing blocks are written with one write per run of consecutive
+    blocks. The device then sees a few large I/Os instead of many small ones.
+***/
+#define BATCH_MAX_WORKERS 4
+/* smaller windows are compared by the caller alone */
+#define BATCH_INLINE_BLOCKS 4
+
+struct BatchWindow {
+	const unsigned char *data;
+	size_t len;
+	const unsigned char *target;
+	size_t n_target;
+	bool *same;                   /* per BLOCK_SIZE block */
+	size_t n_blocks;
+	size_t n_slices;
+};
+
+struct BatchWorker {
+	struct BatchPool *pool;
+	size_t id;                    /* slice 0 is the caller's */
+	pthread_t thread;
+};
+
+/* Compare threads kept for the whole run, woken up for every window. */
+struct BatchPool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;          /* workers wait for the next window */
+	pthread_cond_t done;          /* the caller waits for the slices */
+	struct BatchWorker workers[BATCH_MAX_WORKERS - 1];
+	size_t n_workers;
+	const struct BatchWindow *win;
+	uint64_t generation;          /* of the current window */
+	size_t n_pending;             /* workers not done with it yet */
+	bool stop;
+};
+
+static void batch_compare_slice(const struct BatchWindow *win, size_t id) {
+	for (size_t i = id; i < win->n_blocks; i += win->n_slices) {
+	    size_t start = i * BLOCK_SIZE;
+	    size_t len = MIN(BLOCK_SIZE, win->len - start);
+	    win->same[i] = ((start + len <= win->n_target) &&
+	                    (memcmp(win->data + start, win->target + start, len) == 0));
+	}
+}
+
+static void *batch_worker(void *arg) {
+	struct BatchWorker *worker = arg;
+	struct BatchPool *pool = worker->pool;
+	uint64_t generation = 0;
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+	    while (!pool->stop && (pool->generation == generation)) {
+	        pthread_cond_wait(&pool->work, &pool->lock);
+	    }
+	    if (pool->stop) {
+	        break;
+	    }
+	    generation = pool->generation;
+	    const struct BatchWindow *win = pool->win;
+	    pthread_mutex_unlock(&pool->lock);
+
+	    batch_compare_slice(win, worker->id);
+
+	    pthread_mutex_lock(&pool->lock);
+	    if (--pool->n_pending == 0) {
+	        pthread_cond_signal(&pool->done);
+	    }
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Starts as many workers as possible, with none the caller compares alone. */
+static void batch_pool_init(struct BatchPool *pool) {
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (size_t i = 0; i < BATCH_MAX_WORKERS - 1; i++) {
+	    struct BatchWorker *worker = &pool->workers[pool->n_workers];
+	    worker->pool = pool;
+	    worker->id = pool->n_workers + 1;
+	    if (pthread_create(&worker->thread, NULL, batch_worker, worker) != 0) {
+	        break;
+	    }
+	    pool->n_workers++;
+	}
+}
+
+static void batch_pool_destroy(struct BatchPool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (size_t i = 0; i < pool->n_workers; i++) {
+	    pthread_join(pool->workers[i].thread, NULL);
+	}
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+static void batch_compare(struct BatchPool *pool, struct BatchWindow *win) {
+	if ((pool->n_workers == 0) || (win->n_blocks < BATCH_INLINE_BLOCKS)) {
+	    win->n_slices = 1;
+	    batch_compare_slice(win, 0);
+	    return;
+	}
+	win->n_slices = pool->n_workers + 1;
+	pthread_mutex_lock(&pool->lock);
+	pool->win = win;
+	pool->n_pending = pool->n_workers;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	batch_compare_slice(win, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->n_pending > 0) {
+	    pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+bool shovel_batched(int in_fd, int out_fd, size_t len, const struct ShovelOptions *opts,
+                    struct Stats *stats, int *error) {
+	size_t window = opts->batch_size;
+	unsigned char *data = malloc(window);
+	unsigned char *target = malloc(window);
+	bool *same = calloc(window / BLOCK_SIZE, sizeof(bool));
+	struct WearState wear = { 0 };
+	off_t offset = lseek(out_fd, 0, SEEK_CUR);
+	bool ready = ((data != NULL) && (target != NULL) && (same != NULL) && (offset != -1));
+	if (!ready) {
+	    fprintf(stderr, "Failed to set up batched compare: %m\n");
+	    *error = errno;
+	}
+	struct BatchPool pool;
+	if (ready) {
+	    batch_pool_init(&pool);
+	}
+	bool success = ready;
+	size_t n_unsynced = 0;
+	size_t sync_window = opts->fsync_interval;
+	uint64_t next_mem_check = 0;
+	while (success && (len > 0)) {
+	    stats_shm_publish(stats);
+	    if (opts->adapt_memory && (now_us() >= next_mem_check)) {
+	        sync_window = mem_adapt(opts, stats);
+	        next_mem_check = now_us() + MEM_CHECK_INTERVAL_US;
+	    }
+
+	    /* collect the window, BLOCK_SIZE chunks (except for the last one) */
+	    perf_phase(PHASE_INPUT);
+	    size_t n_data = 0;
+	    while (success && (n_data < window) && (n_data < len)) {
+	        ssize_t n_read = input_append(in_fd, opts, data + n_data, len - n_data,
+	                                      offset + n_data, stats, error);
+	        success = (n_read > 0);
+	        n_data += success ? n_read : 0;
+	    }
+	    if (!success) {
+	        break;
+	    }
+
+	    /* one read of the target for the whole window, unless the index
+	       already told us everything */
+	    perf_phase(PHASE_COMPARE);
+	    struct BatchWindow win = {
+	        .data = data,
+	        .len = n_data,
+	        .target = target,
+	        .same = same,
+	        .n_blocks = (n_data + BLOCK_SIZE - 1) / BLOCK_SIZE,
+	    };
+	    uint64_t first_block = offset / BLOCK_SIZE;
+	    if ((opts->planned == NULL) || (opts->erase_size != 0)) {
+	        ssize_t n_target = buf_pio((pio_fn_t)pread, out_fd, target, n_data, offset);
+	        if (n_target < 0) {
+	            fprintf(stderr, "Failed to read data from the target: %m\n");
+	            *error = errno;
+	            success = false;
+	            break;
+	        }
+	        win.n_target = n_target;
+	        batch_compare(&pool, &win);
+	    }
+	    if (opts->planned != NULL) {
+	        for (size_t i = 0; i < win.n_blocks; i++) {
+	            same[i] = opts->planned[first_block + i];
+	        }
+	    }
+
+	    /* coalesced writes of the runs of differing blocks */
+	    for (size_t i = 0; success && (i < win.n_blocks); ) {
+	        if (same[i]) {
+	            stats->blocks_omitted++;
+	            i++;
+	            continue;
+	        }
+	        size_t end = i;
+	        while ((end < win.n_blocks) && !same[end]) {
+	            if (opts->erase_size != 0) {
+	                size_t start = end * BLOCK_SIZE;
+	                size_t n = MIN(BLOCK_SIZE, n_data - start);
+	                size_t n_target = (win.n_target > start) ? MIN(n, win.n_target - start) : 0;
+	                account_wear(stats, &wear, opts->erase_size, offset + start, data + start,
+	                             n, target + start, n_target);
+	            }
+	            end++;
+	        }
+	        size_t start = i * BLOCK_SIZE;
+	        size_t n = MIN(end * BLOCK_SIZE, n_data) - start;
+	        perf_phase(PHASE_WRITE);
+	        if (opts->throttle != NULL) {
+	            throttle_write(opts->throttle, n, stats);
+	        }
+	        ssize_t n_written = buf_pio((pio_fn_t)pwrite, out_fd, data + start, n, offset + start);
+	        if ((n_written < 0) || ((size_t) n_written != n)) {
+	            fprintf(stderr, "Failed to write data: %m\n");
+	            *error = errno;
+	            success = false;
+	            break;
+	        }
+	        stats->blocks_written += end - i;
+	        stats->bytes_written += n_written;
+	        n_unsynced += n_written;
+	        i = end;
+	    }
+	    if (!success) {
+	        break;
+	    }
+	    stats->total_bytes += n_data;
+	    len -= n_data;
+	    offset += n_data;
+	    if ((opts->fsync_interval != 0) && (n_unsynced >= sync_window)) {
+	        sync_target(out_fd, offset, opts, stats);
+	        n_unsynced = 0;
+	    }
+	}
+
+	if (success && (opts->fsync_interval != 0) && (n_unsynced > 0)) {
+	    sync_target(out_fd, offset, opts, stats);
+	}
+	if (success && (lseek(out_fd, offset, SEEK_SET) == -1)) {
+	    fprintf(stderr, "Failed to seek on the target: %m\n");
+	    *error = errno;
+	    success = false;
+	}
+	if (ready) {
+	    batch_pool_destroy(&pool);
+	}
+	free(data);
+	free(target);
+	free(same);
+	return success;
+}
+
+/***
+    Differential updates of dynamic UBI volumes. Instead of rewriting the
+    whole volume with UBI_IOCVOLUP, the input is compared with the volume LEB
+    by LEB and only the differing LEBs are replaced, each atomically with
+    UBI_IOCEBCH. Unchanged LEBs are never erased. The LEBs after the end of
+    the image are unmapped, as a volume update would leave them.
+
+    The update as a whole is not atomic (neither is UBI_IOCVOLUP, which marks
+    the volume as corrupted if interrupted), but every LEB has either its old
+    or its new contents.
+
+    Volumes are character devices with a dynamic major number, so they are
+    recognized by their sysfs entries. In builds with TEST_HOOKS, the
+    MENDER_FLASH_UBI_FAKE_LEB_SIZE environment variable makes a regular file
+    target stand in for a dynamic volume with LEBs of the given size.
+***/
+struct UbiVolume {
+	bool fake;
+	size_t leb_size;              /* usable bytes per LEB */
+	uint64_t n_lebs;              /* reserved for the volume */
+};
+
+static bool ubi_sysfs_read(const struct stat *vol_stat, const char *attr, char *buf, size_t size) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/sys/dev/%s/%u:%u/%s", S_ISCHR(vol_stat->st_mode) ? "char" : "block",
+	         major(vol_stat->st_rdev), minor(vol_stat->st_rdev), attr);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+	    return false;
+	}
+	bool ok = (fgets(buf, size, f) != NULL);
+	fclose(f);
+	return ok;
+}
+
+/* Whether the target is a UBI volume, i.e. a character device of the ubi
+ * subsystem with a volume type (the UBI devices themselves have none). */
+bool ubi_volume(const struct stat *vol_stat) {
+	if (!S_ISCHR(vol_stat->st_mode)) {
+	    return false;
+	}
+	char path[PATH_MAX];
+	char subsystem[PATH_MAX];
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/subsystem",
+	         major(vol_stat->st_rdev), minor(vol_stat->st_rdev));
+	ssize_t n = readlink(path, subsystem, sizeof(subsystem) - 1);
+	if (n == -1) {
+	    return false;
+	}
+	subsystem[n] = '\0';
+	const char *name = strrchr(subsystem, '/');
+	name = (name != NULL) ? name + 1 : subsystem;
+	char type[16];
+	return ((strcmp(name, "ubi") == 0) && ubi_sysfs_read(vol_stat, "type", type, sizeof(type)));
+}
+
+/* Whether the target is a dynamic UBI volume (or the fake one), fills vol if so. */
+bool ubi_dynamic_volume(const struct stat *vol_stat, bool is_ubi, struct UbiVolume *vol) {
+	memset(vol, 0, sizeof(*vol));
+#ifdef TEST_HOOKS
+	const char *fake = getenv("MENDER_FLASH_UBI_FAKE_LEB_SIZE");
+	if ((fake != NULL) && S_ISREG(vol_stat->st_mode)) {
+	    vol->fake = true;
+	    vol->leb_size = strtoul(fake, NULL, 10);
+	    vol->n_lebs = (vol->leb_size > 0) ? (vol_stat->st_size + vol->leb_size - 1) / vol->leb_size : 0;
+	    return (vol->leb_size > 0);
+	}
+#endif  /* TEST_HOOKS */
+	char type[16], leb_size[32], n_lebs[32];
+	if (!is_ubi || !ubi_sysfs_read(vol_stat, "type", type, sizeof(type)) ||
+	    (strncmp(type, "dynamic", strlen("dynamic")) != 0) ||
+	    !ubi_sysfs_read(vol_stat, "usable_eb_size", leb_size, sizeof(leb_size)) ||
+	    !ubi_sysfs_read(vol_stat, "reserved_ebs", n_lebs, sizeof(n_lebs))) {
+	    return false;
+	}
+	vol->leb_size = strtoul(leb_size, NULL, 10);
+	vol->n_lebs = strtoull(n_lebs, NULL, 10);
+	return (vol->leb_size > 0);
+}
+
+/* Atomically replaces the contents of LEB lnum with len bytes of data. */
+static bool ubi_leb_change(int vol_fd, const struct UbiVolume *vol, uint32_t lnum,
+                           const unsigned char *data, size_t len) {
+	if (vol->fake) {
+	    return (buf_pio((pio_fn_t)pwrite, vol_fd, (unsigned char *) data, len,
+	                    (off_t) lnum * vol->leb_size) == (ssize_t) len);
+	}
+	struct ubi_leb_change_req req = {
+		.lnum = lnum,
+		.bytes = len,
+	};
+	if (ioctl(vol_fd, UBI_IOCEBCH, &req) == -1) {
+	    return false;
+	}
+	/* the data of the change are just written to the volume */
+	return (buf_io((io_fn_t)write, vol_fd, (unsigned char *) data, len) == (ssize_t) len);
+}
+
+/* Unmaps the (mapped) LEBs from first_unused on, returns their number or -1. */
+static ssize_t ubi_unmap_tail(int vol_fd, const struct UbiVolume *vol, uint64_t first_unused,
+                              uint64_t image_size) {
+	if (vol->fake) {
+	    ssize_t n = (vol->n_lebs > first_unused) ? vol->n_lebs - first_unused : 0;
+	    return (ftruncate(vol_fd, image_size) == 0) ? n : -1;
+	}
+	ssize_t n_unmapped = 0;
+	for (uint64_t lnum = first_unused; lnum < vol->n_lebs; lnum++) {
+	    int32_t leb = lnum;
+	    int ret = ioctl(vol_fd, UBI_IOCEBISMAP, &leb);
+	    if ((ret == 1) && (ioctl(vol_fd, UBI_IOCEBUNMAP, &leb) == 0)) {
+	        n_unmapped++;
+	    } else if (ret != 0) {
+	        return -1;
+	    }
+	}
+	return n_unmapped;
+}
+
+bool shovel_ubi(int in_fd, int vol_fd, size_t len, const struct UbiVolume *vol,
+                const struct ShovelOptions *opts, struct Stats *stats, int *error) {
+	if ((len > vol->n_lebs * vol->leb_size) && !vol->fake) {
+	    fprintf(stderr, "Input does not fit into the volume (%ju LEBs of %zu bytes)\n",
+	            (intmax_t) vol->n_lebs, vol->leb_size);
+	    *error = ENOSPC;
+	    return false;
+	}
+	/* a LEB of input plus what's left of the last BLOCK_SIZE chunk */
+	unsigned char *data = malloc(vol->leb_size + BLOCK_SIZE);
+	unsigned char *current = malloc(vol->leb_size);
+	if ((data == NULL) || (current == NULL)) {
+	    fprintf(stderr, "Failed to allocate memory: %m\n");
+	    *error = errno;
+	    free(data);
+	    free(current);
+	    return false;
+	}
+	size_t image_size = len;
+	size_t n_data = 0;
+	off_t in_offset = 0;
+	bool success = true;
+	uint32_t lnum = 0;
+	for (; success && (len > 0); lnum++) {
+	    stats_shm_publish(stats);
+	    perf_phase(PHASE_INPUT);
+	    size_t n_leb = MIN(vol->leb_size, len);
+	    while (n_data < n_leb) {
+	        ssize_t n_read = input_append(in_fd, opts, data + n_data, len - n_data, in_offset,
+	                                      stats, error);
+	        if (n_read <= 0) {
+	            success = false;
+	            break;
+	        }
+	        n_data += n_read;
+	        in_offset += n_read;
+	    }
+	    if (!success) {
+	        break;
+	    }
+
+	    /* what's not there (beyond the end of the fake) reads as erased */
+	    perf_phase(PHASE_COMPARE);
+	    ssize_t n_current = buf_pio((pio_fn_t)pread, vol_fd, current, vol->leb_size,
+	                                (off_t) lnum * vol->leb_size);
+	    if (n_current < 0) {
+	        fprintf(stderr, "Failed to read LEB %" PRIu32 " of the volume: %m\n", lnum);
+	        *error = errno;
+	        success = false;
+	        break;
+	    }
+	    memset(current + n_current, 0xFF, vol->leb_size - n_current);
+	    bool same = (memcmp(data, current, n_leb) == 0);
+	    if (same && (n_leb < vol->leb_size) && !vol->fake) {
+	        /* a shorter LEB written now would leave the rest erased */
+	        same = ((current[n_leb] == 0xFF) &&
+	                (memcmp(current + n_leb, current + n_leb + 1, vol->leb_size - n_leb - 1) == 0));
+	    }
+
+	    if (same) {
+	        stats->lebs_unchanged++;
+	    } else {
+	        perf_phase(PHASE_WRITE);
+	        if (opts->throttle != NULL) {
+	            throttle_write(opts->throttle, n_leb, stats);
+	        }
+	        if (!ubi_leb_change(vol_fd, vol, lnum, data, n_leb)) {
+	            fprintf(stderr, "Failed to change LEB %" PRIu32 " of the volume: %m\n", lnum);
+	            *error = errno;
+	            success = false;
+	            break;
+	        }
+	        stats->lebs_changed++;
+	        stats->bytes_written += n_leb;
+	    }
+	    stats->total_bytes += n_leb;
+	    len -= n_leb;
+	    n_data -= n_leb;
+	    memmove(data, data + n_leb, n_data);
+	}
+
+	if (success) {
+	    ssize_t n_unmapped = ubi_unmap_tail(vol_fd, vol, lnum, image_size);
+	    if (n_unmapped < 0) {
+	        fprintf(stderr, "Failed to unmap the LEBs after the image: %m\n");
+	        *error = errno;
+	        success = false;
+	    } else {
+	        stats->lebs_unmapped = n_unmapped;
+	    }
+	}
+	if (success && (timed_fsync(vol_fd, stats) == -1)) {
+	    fprintf(stderr, "warning: Failed to fsync data to target: %m\n");
+	}
+	free(data);
+	free(current);
+	return success;
+}
+
+/***
+    Framed input. Instead of one ordered byte stream, the input can be one or
+    more streams of self-describing records, each carrying its offset in the
+    image, so that a downloader using multiple connections can pipe them in as
+    they arrive. All integers are little-endian. A stream starts with
+
+        char     magic[8];      "MFFRAMED"
+        uint32_t version;       1
+        uint32_t reserved;      0
+        uint64_t image_size;    must be the same in all streams
+
+    and is followed by records, each with a header
+
+        uint32_t magic;         "MFRC"
+        uint16_t type;          FRAME_* below
+        uint16_t flags;         0
+        uint64_t offset;
+        uint64_t length;
+        uint32_t fill;          the byte to fill with for FRAME_FILL
+        uint32_t checksum;      CRC-32 of the header with checksum = 0 and
+                                the payload
+
+    followed by length bytes of payload for FRAME_DATA (at most BLOCK_SIZE so
+    that it can be verified before it is written). FRAME_SKIP marks a range
+    that is to be kept as it is on the target. FRAME_END (offset and length 0)
+    ends the stream. The image is complete once the records of all streams
+    together cover it.
+***/
+#define FRAMED_STREAM_MAGIC "MFFRAMED"
+#define FRAMED_STREAM_HEADER_SIZE 24
+#define FRAMED_RECORD_MAGIC 0x4352464DU    /* "MFRC" */
+#define FRAMED_RECORD_HEADER_SIZE 32
+#define FRAMED_MAX_STREAMS 16
+
+enum {
+	FRAME_DATA = 1,
+	FRAME_ZERO = 2,
+	FRAME_FILL = 3,
+	FRAME_SKIP = 4,
+	FRAME_END = 5,
+};
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_table() {
+	for (uint32_t i = 0; i < 256; i++) {
+	    uint32_t c = i;
+	    for (int k = 0; k < 8; k++) {
+	        c = (c & 1) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
+	    }
+	    crc32_table[i] = c;
+	}
+}
+
+/* CRC-32 as used by zlib/gzip, crc is 0 for the first call. */
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t len) {
+	pthread_once(&crc32_once, crc32_init_table);
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++) {
+	    crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/* Union of the byte ranges of the image written so far. */
+struct Coverage {
+	pthread_mutex_t lock;
+	struct Range {
+	    uint64_t start;
+	    uint64_t end;
+	} *ranges;
+	size_t n_ranges;
+	size_t capacity;
+	uint64_t covered;
+};
+
+bool coverage_add(struct Coverage *cov, uint64_t start, uint64_t end) {
+	if (start >= end) {
+	    return true;
+	}
+	pthread_mutex_lock(&cov->lock);
+	/* first range that ends at or after start (touching ranges are merged) */
+	size_t i = 0;
+	while ((i < cov->n_ranges) && (cov->ranges[i].end < start)) {
+	    i++;
+	}
+	size_t j = i;
+	uint64_t merged = 0;
+	while ((j < cov->n_ranges) && (cov->ranges[j].start <= end)) {
+	    start = MIN(start, cov->ranges[j].start);
+	    end = (cov->ranges[j].end > end) ? cov->ranges[j].end : end;
+	    merged += cov->ranges[j].end - cov->ranges[j].start;
+	    j++;
+	}
+	if (j == i) {
+	    if (cov->n_ranges == cov->capacity) {
+	        size_t capacity = (cov->capacity == 0) ? 16 : 2 * cov->capacity;
+	        struct Range *ranges = realloc(cov->ranges, capacity * sizeof(struct Range));
+	        if (ranges == NULL) {
+	            pthread_mutex_unlock(&cov->lock);
+	            return false;
+	        }
+	        cov->ranges = ranges;
+	        cov->capacity = capacity;
+	    }
+	    memmove(&cov->ranges[i + 1], &cov->ranges[i], (cov->n_ranges - i) * sizeof(struct Range));
+	    cov->n_ranges++;
+	} else {
+	    memmove(&cov->ranges[i + 1], &cov->ranges[j], (cov->n_ranges - j) * sizeof(struct Range));
+	    cov->n_ranges -= (j - i - 1);
+	}
+	cov->ranges[i].start = start;
+	cov->ranges[i].end = end;
+	cov->covered += (end - start) - merged;
+	pthread_mutex_unlock(&cov->lock);
+	return true;
+}
+
+struct FramedStream {
+	int in_fd;
+	const char *name;
+	int out_fd;
+	uint64_t image_size;
+	const struct ShovelOptions *opts;
+	struct Coverage *coverage;
+	struct Stats stats;
+	size_t n_records;
+	int error;
+	bool success;
+};
+
+/* Writes (or omits if the target already has them) len bytes of data at offset
+ * of the target. */
+static bool framed_write(struct FramedStream *stream, uint64_t offset, const unsigned char *data,
+                         size_t len, unsigned char *scratch, size_t *n_unsynced) {
+	const struct ShovelOptions *opts = stream->opts;
+	if (opts->write_optimized) {
+	    size_t n_target;
+	    int same = compare_target(stream->out_fd, offset, data, len, scratch,
+	                              false, &n_target, &stream->stats);
+	    if (same < 0) {
+	        fprintf(stderr, "Failed to read data from the target: %m\n");
+	        stream->error = errno;
+	        return false;
+	    }
+	    if (same == 1) {
+	        stream->stats.blocks_omitted++;
+	        stream->stats.total_bytes += len;
+	        return true;
+	    }
+	}
+	ssize_t n_written = buf_pio((pio_fn_t)pwrite, stream->out_fd, (unsigned char *) data, len, offset);
+	if ((n_written < 0) || ((size_t) n_written != len)) {
+	    fprintf(stderr, "Failed to write data: %m\n");
+	    stream->error = errno;
+	    return false;
+	}
+	stream->stats.total_bytes += len;
+	stream->stats.blocks_written++;
+	stream->stats.bytes_written += len;
+	if (opts->fsync_interval != 0) {
+	    *n_unsynced += len;
+	    if (*n_unsynced >= opts->fsync_interval) {
+	        if (stream_fsync(stream->out_fd, &stream->stats) == -1) {
+	            fprintf(stderr, "warning: Failed to fsync data to target: %m\n");
+	        }
+	        *n_unsynced = 0;
+	    }
+	}
+	return true;
+}
+
+static bool framed_read(struct FramedStream *stream, unsigned char *buf, size_t len) {
+	ssize_t n_read = buf_io((io_fn_t)read, stream->in_fd, buf, len);
+	if (n_read < 0) {
+	    fprintf(stderr, "Failed to read data from '%s': %m\n", stream->name);
+	    stream->error = errno;
+	    return false;
+	}
+	if ((size_t) n_read != len) {
+	    fprintf(stderr, "Unexpected end of input in '%s'!\n", stream->name);
+	    return false;
+	}
+	return true;
+}
+
+static bool framed_process(struct FramedStream *stream, unsigned char *data, unsigned char *scratch) {
+	unsigned char header[FRAMED_RECORD_HEADER_SIZE];
+	size_t n_unsynced = 0;
+	while (true) {
+	    if (!framed_read(stream, header, FRAMED_RECORD_HEADER_SIZE)) {
+	        return false;
+	    }
+	    uint32_t magic = get_le(header, 4);
+	    uint16_t type = get_le(header + 4, 2);
+	    uint16_t flags = get_le(header + 6, 2);
+	    uint64_t offset = get_le(header + 8, 8);
+	    uint64_t length = get_le(header + 16, 8);
+	    unsigned char fill = header[24];
+	    uint32_t checksum = get_le(header + 28, 4);
+	    if (magic != FRAMED_RECORD_MAGIC) {
+	        fprintf(stderr, "Invalid record in '%s'\n", stream->name);
+	        return false;
+	    }
+	    if (flags != 0) {
+	        fprintf(stderr, "Unsupported record flags 0x%x in '%s'\n", flags, stream->name);
+	        return false;
+	    }
+	    if ((offset > stream->image_size) || (length > (stream->image_size - offset)) ||
+	        ((type == FRAME_DATA) && (length > BLOCK_SIZE))) {
+	        fprintf(stderr, "Invalid record range in '%s': %ju+%ju\n", stream->name,
+	                (uintmax_t) offset, (uintmax_t) length);
+	        return false;
+	    }
+
+	    memset(header + 28, 0, 4);
+	    uint32_t crc = crc32_update(0, header, FRAMED_RECORD_HEADER_SIZE);
+	    if (type == FRAME_DATA) {
+	        if (!framed_read(stream, data, length)) {
+	            return false;
+	        }
+	        crc = crc32_update(crc, data, length);
+	    }
+	    if (crc != checksum) {
+	        fprintf(stderr, "Record checksum mismatch in '%s' at offset %ju\n", stream->name,
+	                (uintmax_t) offset);
+	        return false;
+	    }
+	    stream->n_records++;
+
+	    switch (type) {
+	    case FRAME_END:
+	        if ((n_unsynced > 0) && (stream_fsync(stream->out_fd, &stream->stats) == -1)) {
+	            fprintf(stderr, "warning: Failed to fsync data to target: %m\n");
+	        }
+	        return true;
+	    case FRAME_DATA:
+	        if (!framed_write(stream, offset, data, length, scratch, &n_unsynced)) {
+	            return false;
+	        }
+	        break;
+	    case FRAME_ZERO:
+	    case FRAME_FILL:
+	        memset(data, (type == FRAME_ZERO) ? 0 : fill, MIN(BLOCK_SIZE, length));
+	        for (uint64_t pos = 0; pos < length; pos += BLOCK_SIZE) {
+	            if (!framed_write(stream, offset + pos, data, MIN(BLOCK_SIZE, length - pos),
+	                              scratch, &n_unsynced)) {
+	                return false;
+	            }
+	        }
+	        break;
+	    case FRAME_SKIP:
+	        stream->stats.total_bytes += length;
+	        break;
+	    default:
+	        fprintf(stderr, "Unknown record type %u in '%s'\n", type, stream->name);
+	        return false;
+	    }
+	    if (!coverage_add(stream->coverage, offset, offset + length)) {
+	        stream->error = ENOMEM;
+	        return false;
+	    }
+	}
+}
+
+static void *framed_worker(void *arg) {
+	struct FramedStream *stream = arg;
+	unsigned char *data = malloc(BLOCK_SIZE);
+	unsigned char *scratch = malloc(BLOCK_SIZE);
+	if ((data == NULL) || (scratch == NULL)) {
+	    stream->error = ENOMEM;
+	} else {
+	    stream->success = framed_process(stream, data, scratch);
+	}
+	free(data);
+	free(scratch);
+	return NULL;
+}
+
+/* Opens the given framed input stream and reads its header. "-" is the standard
+ * input, "fd:N" an already open file descriptor (e.g. a socket). */
+int framed_open(const char *path, uint64_t *image_size) {
+	int fd;
+	if (strcmp(path, "-") == 0) {
+	    fd = STDIN_FILENO;
+	} else if (strncmp(path, "fd:", 3) == 0) {
+	    char *end;
+	    long ret = strtol(path + 3, &end, 10);
+	    if ((path[3] == '\0') || (*end != '\0') || (ret < 0) || (ret > INT_MAX)) {
+	        fprintf(stderr, "Invalid file descriptor given: %s\n", path);
+	        return -1;
+	    }
+	    fd = ret;
+	} else {
+	    fd = open(path, O_RDONLY);
+	    if (fd == -1) {
+	        fprintf(stderr, "Failed to open '%s' for reading: %m\n", path);
+	        return -1;
+	    }
+	}
+
+	unsigned char header[FRAMED_STREAM_HEADER_SIZE];
+	ssize_t n_read = buf_io((io_fn_t)read, fd, header, FRAMED_STREAM_HEADER_SIZE);
+	if ((n_read != FRAMED_STREAM_HEADER_SIZE) ||
+	    (memcmp(header, FRAMED_STREAM_MAGIC, 8) != 0) || (get_le(header + 8, 4) != 1)) {
+	    fprintf(stderr, "Invalid framed stream header in '%s'\n", path);
+	    close(fd);
+	    return -1;
+	}
+	*image_size = get_le(header + 16, 8);
+	return fd;
+}
+
+/* Processes all the given framed input streams concurrently. Fails unless the
+ * image of image_size bytes (or the size from the streams if 0) is complete at
+ * the end. */
+bool flash_framed(char **input_paths, size_t n_inputs, int out_fd, uint64_t *image_size,
+                  const struct ShovelOptions *opts, struct Stats *stats,
+                  size_t *n_records, int *error) {
+	struct FramedStream streams[FRAMED_MAX_STREAMS] = {0};
+	pthread_t threads[FRAMED_MAX_STREAMS];
+	struct Coverage coverage = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	size_t n_opened = 0;
+	bool success = true;
+
+	for (size_t i = 0; i < n_inputs; i++) {
+	    uint64_t size;
+	    int fd = framed_open(input_paths[i], &size);
+	    if (fd == -1) {
+	        success = false;
+	        break;
+	    }
+	    streams[i].in_fd = fd;
+	    n_opened++;
+	    if (*image_size == 0) {
+	        *image_size = size;
+	    } else if (size != *image_size) {
+	        fprintf(stderr, "Image size %ju in '%s' doesn't match %ju\n",
+	                (uintmax_t) size, input_paths[i], (uintmax_t) *image_size);
+	        success = false;
+	        break;
+	    }
+	}
+
+	size_t n_started = 0;
+	for (size_t i = 0; success && (i < n_inputs); i++) {
+	    streams[i].name = input_paths[i];
+	    streams[i].out_fd = out_fd;
+	    streams[i].image_size = *image_size;
+	    streams[i].opts = opts;
+	    streams[i].coverage = &coverage;
+	    int ret = pthread_create(&threads[i], NULL, framed_worker, &streams[i]);
+	    if (ret != 0) {
+	        *error = ret;
+	        success = false;
+	        break;
+	    }
+	    n_started++;
+	}
+	for (size_t i = 0; i < n_started; i++) {
+	    pthread_join(threads[i], NULL);
+	    if (!streams[i].success) {
+	        success = false;
+	        if (*error == 0) {
+	            *error = streams[i].error;
+	        }
+	    }
+	    stats->blocks_written += streams[i].stats.blocks_written;
+	    stats->blocks_omitted += streams[i].stats.blocks_omitted;
+	    stats->bytes_written += streams[i].stats.bytes_written;
+	    stats->total_bytes += streams[i].stats.total_bytes;
+	    stats->bytes_cached += streams[i].stats.bytes_cached;
+	    for (size_t j = 0; j < streams[i].stats.n_fsyncs; j++) {
+	        record_fsync_latency(stats, streams[i].stats.fsync_us[j]);
+	    }
+	    free(streams[i].stats.fsync_us);
+	    *n_records += streams[i].n_records;
+	}
+	for (size_t i = 0; i < n_opened; i++) {
+	    if (streams[i].in_fd != STDIN_FILENO) {
+	        close(streams[i].in_fd);
+	    }
+	}
+
+	if (success && (coverage.covered != *image_size)) {
+	    fprintf(stderr, "Image incomplete: %ju of %ju bytes received\n",
+	            (uintmax_t) coverage.covered, (uintmax_t) *image_size);
+	    success = false;
+	}
+	free(coverage.ranges);
+	return success;
+}
+
+/* The whole run with framed input (see flash_framed()). */
+int run_framed(char **input_paths, size_t n_inputs, const char *output_path,
+               uint64_t image_size, bool write_optimized, size_t fsync_interval) {
+	int out_fd = open(output_path, O_CREAT | (write_optimized ? O_RDWR : O_WRONLY), 0600);
+	if (out_fd == -1) {
+		fprintf(stderr, "Failed to open '%s' for writing: %m\n", output_path);
+		return EXIT_FAILURE;
+	}
+	struct stat out_fd_stat;
+	if (fstat(out_fd, &out_fd_stat) == -1) {
+		close(out_fd);
+		fprintf(stderr, "Failed to stat() output '%s': %m\n", output_path);
+		return EXIT_FAILURE;
+	}
+	if (ubi_volume(&out_fd_stat)) {
+		close(out_fd);
+		fprintf(stderr, "Framed input is not supported for UBI volumes\n");
+		return EXIT_FAILURE;
+	}
+
+	struct ShovelOptions opts = {
+		.write_optimized = write_optimized,
+		.fsync_interval = fsync_interval,
+	};
+	struct Stats stats = {0};
+	size_t n_records = 0;
+	int error = 0;
+	bool success = flash_framed(input_paths, n_inputs, out_fd, &image_size, &opts,
+	                            &stats, &n_records, &error);
+	if (success && S_ISREG(out_fd_stat.st_mode) && ((uint64_t) out_fd_stat.st_size < image_size)) {
+		/* Skipped ranges at the end don't extend the file. */
+		if (ftruncate(out_fd, image_size) == -1) {
+			fprintf(stderr, "Failed to resize '%s': %m\n", output_path);
+			success = false;
+		}
+	}
+	if (success && (fsync_interval != 0) && (timed_fsync(out_fd, &stats) == -1)) {
+		fprintf(stderr, "warning: Failed to fsync data to target: %m\n");
+	}
+	close(out_fd);
+
+	if (!success) {
+		if (error != 0) {
+			fprintf(stderr, "Failed to copy data: %s\n", strerror(error));
+		} else {
+			fprintf(stderr, "Failed to copy data\n");
+		}
+		printf("Total bytes written: %ju\n", (intmax_t) stats.total_bytes);
+		return EXIT_FAILURE;
+	}
+	puts("================ STATISTICS ================");
+	printf("Blocks written: %10zu\n", stats.blocks_written);
+	printf("Blocks omitted: %10zu\n", stats.blocks_omitted);
+	printf("Bytes written: %11ju\n", (intmax_t) stats.bytes_written);
+	printf("Total bytes: %13ju\n", (intmax_t) stats.total_bytes);
+	printf("Streams: %17zu\n", n_inputs);
+	printf("Records: %17zu\n", n_records);
+	puts("============================================");
+	free(stats.fsync_us);
+	return 0;
+}
+
+/***
+    Sampled verification (--verify-sample). After the final sync, randomly
+    chosen blocks are read back from the target, bypassing the page cache
+    (O_DIRECT, or dropping the cached pages where that's not supported), by
+    several threads at once and compared with the input, the index or, for
+    non-seekable input, the CRC-32 of each block recorded while copying.
+
+    With k blocks out of N sampled and no mismatch found, the reported bound
+    is the number of bad blocks d for which such a clean sample would have
+    had less than a 5% chance, i.e. the smallest d with
+
+        (N-d)/N * (N-d-1)/(N-1) * ... * (N-d-k+1)/(N-k+1) <= 0.05
+***/
+#define VERIFY_MAX_WORKERS 4
+#define VERIFY_ALIGN 4096
+
+struct Verify {
+	int target_fd;
+	bool direct;
+	size_t direct_align;            /* from the probe, 0 if O_DIRECT isn't supported */
+	int in_fd;                      /* -1 if the input can't be re-read */
+	off_t in_base;
+	const struct Index *index;
+	uint32_t *block_crcs;
+	uint64_t image_size;
+	const uint64_t *sample;
+	size_t n_sample;
+	_Atomic size_t next;
+	_Atomic size_t n_mismatches;
+	_Atomic uint64_t first_bad;     /* offset, UINT64_MAX if none */
+	_Atomic int error;
+	/* results */
+	uint64_t n_population;
+	bool verified;
+};
+
+static uint64_t xorshift64(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+/* Picks n_sample distinct blocks from [first, n_blocks) in random order. */
+uint64_t *verify_pick(uint64_t first, uint64_t n_blocks, size_t n_sample) {
+	uint64_t n = n_blocks - first;
+	uint64_t *blocks = malloc(MAX(n, 1) * sizeof(uint64_t));
+	if (blocks == NULL) {
+	    return NULL;
+	}
+	uint64_t seed = now_us() ^ ((uint64_t) getpid() << 32);
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd != -1) {
+	    if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+	        fprintf(stderr, "warning: Failed to get random seed, using the time\n");
+	    }
+	    close(fd);
+	}
+	seed |= 1;
+	for (uint64_t i = 0; i < n; i++) {
+	    blocks[i] = first + i;
+	}
+	/* partial Fisher-Yates */
+	for (size_t i = 0; i < n_sample; i++) {
+	    uint64_t j = i + xorshift64(&seed) % (n - i);
+	    uint64_t tmp = blocks[i];
+	    blocks[i] = blocks[j];
+	    blocks[j] = tmp;
+	}
+	return blocks;
+}
+
+static bool verify_block(struct Verify *v, uint64_t block, unsigned char *target_buf,
+                         unsigned char *input_buf) {
+	off_t offset = block * BLOCK_SIZE;
+	size_t len = MIN(BLOCK_SIZE, v->image_size - offset);
+	/* O_DIRECT needs aligned lengths, the end of the target is fine */
+	size_t read_len = v->direct ? (len + VERIFY_ALIGN - 1) / VERIFY_ALIGN * VERIFY_ALIGN : len;
+	ssize_t n_read;
+	do {
+	    n_read = pread(v->target_fd, target_buf, read_len, offset);
+	} while ((n_read == -1) && (errno == EINTR));
+	if (n_read < 0) {
+	    atomic_store(&v->error, errno);
+	    return false;
+	}
+	if ((size_t) n_read < len) {
+	    return false;
+	}
+	if (v->index != NULL) {
+	    return index_block_matches(v->index, block, target_buf, len);
+	} else if (v->block_crcs != NULL) {
+	    return (crc32_update(0, target_buf, len) == v->block_crcs[block]);
+	}
+	n_read = buf_pio((pio_fn_t)pread, v->in_fd, input_buf, len, v->in_base + offset);
+	if (n_read < 0) {
+	    atomic_store(&v->error, errno);
+	    return false;
+	}
+	return (((size_t) n_read == len) && (memcmp(target_buf, input_buf, len) == 0));
+}
+
+static void *verify_worker(void *arg) {
+	struct Verify *v = arg;
+	unsigned char *target_buf = NULL;
+	unsigned char *input_buf = malloc(BLOCK_SIZE);
+	if ((posix_memalign((void **) &target_buf, VERIFY_ALIGN, BLOCK_SIZE) != 0) ||
+	    (input_buf == NULL)) {
+	    atomic_store(&v->error, ENOMEM);
+	    free(input_buf);
+	    return NULL;
+	}
+	size_t i;
+	while (((i = atomic_fetch_add(&v->next, 1)) < v->n_sample) &&
+	       (atomic_load(&v->error) == 0)) {
+	    uint64_t block = v->sample[i];
+	    if (!verify_block(v, block, target_buf, input_buf) && (atomic_load(&v->error) == 0)) {
+	        atomic_fetch_add(&v->n_mismatches, 1);
+	        uint64_t offset = block * BLOCK_SIZE;
+	        uint64_t first = atomic_load(&v->first_bad);
+	        while ((offset < first) &&
+	               !atomic_compare_exchange_weak(&v->first_bad, &first, offset)) {
+	            continue;
+	        }
+	    }
+	}
+	free(target_buf);
+	free(input_buf);
+	return NULL;
+}
+
+/* Reads back and checks the sample, returns false on I/O errors. */
+bool verify_run(struct Verify *v, const char *target_path) {
+	v->target_fd = -1;
+	if ((v->direct_align > 0) && (VERIFY_ALIGN % v->direct_align == 0)) {
+	    v->target_fd = open(target_path, O_RDONLY | O_DIRECT);
+	}
+	v->direct = (v->target_fd != -1);
+	if (!v->direct) {
+	    v->target_fd = open(target_path, O_RDONLY);
+	    if (v->target_fd == -1) {
+	        return false;
+	    }
+	    /* the data is synced, so the pages are clean and can be dropped */
+	    posix_fadvise(v->target_fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	atomic_store(&v->next, 0);
+	atomic_store(&v->n_mismatches, 0);
+	atomic_store(&v->first_bad, UINT64_MAX);
+	atomic_store(&v->error, 0);
+
+	pthread_t workers[VERIFY_MAX_WORKERS];
+	size_t n_workers = 0;
+	for (; n_workers < MIN(VERIFY_MAX_WORKERS, MAX(v->n_sample, 1)); n_workers++) {
+	    if (pthread_create(&workers[n_workers], NULL, verify_worker, v) != 0) {
+	        break;
+	    }
+	}
+	if (n_workers == 0) {
+	    verify_worker(v);
+	}
+	for (size_t i = 0; i < n_workers; i++) {
+	    pthread_join(workers[i], NULL);
+	}
+	close(v->target_fd);
+	errno = atomic_load(&v->error);
+	return (errno == 0);
+}
+
+/* Chance of a sample of k out of n blocks missing all of d bad ones. */
+double verify_miss_chance(uint64_t n, uint64_t d, uint64_t k) {
+	if (d + k > n) {
+	    return 0.0;
+	}
+	double p = 1.0;
+	for (uint64_t i = 0; (i < k) && (p > 0.0); i++) {
+	    p *= (double) (n - d - i) / (double) (n - i);
+	}
+	return p;
+}
+
+/* Smallest number of bad blocks a clean sample rules out with 95% confidence. */
+uint64_t verify_bound(uint64_t n, uint64_t k) {
+	uint64_t lo = 1;
+	uint64_t hi = n;
+	while (lo < hi) {
+	    uint64_t mid = lo + (hi - lo) / 2;
+	    if (verify_miss_chance(n, mid, k) <= 0.05) {
+	        hi = mid;
+	    } else {
+	        lo = mid + 1;
+	    }
+	}
+	return lo;
+}
+
+/* Verifies a sample of the blocks of the image from first_block on, count
+ * of them or, if count is 0, the given fraction. */
+bool verify_sampled(struct Verify *v, const char *target_path, uint64_t first_block,
+                    size_t count, double fraction) {
+	uint64_t n_blocks = (v->image_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	v->n_population = n_blocks - first_block;
+	if (count == 0) {
+	    count = fraction * v->n_population;
+	    if ((count < fraction * v->n_population) || (count == 0)) {
+	        count++;
+	    }
+	}
+	v->n_sample = MIN(count, v->n_population);
+	uint64_t *sample = verify_pick(first_block, n_blocks, v->n_sample);
+	if (sample == NULL) {
+	    return false;
+	}
+	v->sample = sample;
+	bool ok = verify_run(v, target_path);
+	free(sample);
+	v->sample = NULL;
+	v->verified = ok;
+	return ok;
+}
+
+/***
+    Local performance history. Each successful run can append a one-line
+    summary to a history file. Before that, the run is compared with the
+    median of the previous runs of the same engine on the same target so that
+    storage which gets slower with wear is noticed before updates start to
+    time out. The line format (version 1) is
+
+        1 <time> <target> <engine> <total bytes> <bytes written> <us>
+          <bytes/s> <fsync p50 us> <fsync p95 us> <fsync p99 us>
+***/
+#define HISTORY_VERSION 1
+#define HISTORY_BASELINE_RUNS 10
+#define HISTORY_MIN_BASELINE_RUNS 3
+#define HISTORY_MAX_LINES 1000
+#define HISTORY_REGRESSION_PCT 25
+#define HISTORY_ID_SIZE 256
+
+struct HistoryEntry {
+	char target[HISTORY_ID_SIZE];
+	const char *engine;
+	uint64_t total_bytes;
+	uint64_t bytes_written;
+	uint64_t duration_us;
+	uint64_t throughput;
+	uint64_t fsync_p50;
+	uint64_t fsync_p95;
+	uint64_t fsync_p99;
+};
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Fills in the fsync latency percentiles from the (unsorted) samples. */
+void fsync_percentiles(struct Stats *stats, struct HistoryEntry *entry) {
+	if (stats->n_fsyncs == 0) {
+	    return;
+	}
+	qsort(stats->fsync_us, stats->n_fsyncs, sizeof(uint32_t), cmp_u32);
+	entry->fsync_p50 = stats->fsync_us[(stats->n_fsyncs - 1) * 50 / 100];
+	entry->fsync_p95 = stats->fsync_us[(stats->n_fsyncs - 1) * 95 / 100];
+	entry->fsync_p99 = stats->fsync_us[(stats->n_fsyncs - 1) * 99 / 100];
+}
+
+/* Reads the first line of the given sysfs file into buf, without whitespace. */
+static bool read_sysfs_id(const char *path, char *buf, size_t size) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+	    return false;
+	}
+	bool ok = (fgets(buf, size, f) != NULL);
+	fclose(f);
+	if (ok) {
+	    char *out = buf;
+	    for (char *in = buf; *in != '\0'; in++) {
+	        if ((*in != ' ') && (*in != '\n') && (*in != '\t')) {
+	            *out++ = *in;
+	        }
+	    }
+	    *out = '\0';
+	}
+	return ok && (buf[0] != '\0');
+}
+
+/* Identifies the target so that its history isn't mixed with other devices.
+ * For block devices, the hardware identity (the CID of SD/eMMC, serial
+ * number of others) is added to the path, if available. */
+void target_identity(const char *output_path, const struct stat *out_fd_stat,
+                     char id[HISTORY_ID_SIZE]) {
+	char hw_id[128] = "";
+	if (S_ISBLK(out_fd_stat->st_mode)) {
+	    static const char *const candidates[] = {
+	        "device/cid", "device/serial", "device/wwid",
+	        "../device/cid", "../device/serial", "../device/wwid",
+	    };
+	    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+	        char path[PATH_MAX];
+	        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s",
+	                 major(out_fd_stat->st_rdev), minor(out_fd_stat->st_rdev), candidates[i]);
+	        if (read_sysfs_id(path, hw_id, sizeof(hw_id))) {
+	            break;
+	        }
+	    }
+	}
+	snprintf(id, HISTORY_ID_SIZE, "%s%s%s", output_path, (hw_id[0] != '\0') ? "@" : "", hw_id);
+	for (char *p = id; *p != '\0'; p++) {
+	    if ((*p == ' ') || (*p == '\t') || (*p == '\n')) {
+	        *p = '_';
+	    }
+	}
+}
+
+/* Gets the median throughput and fsync p95 latency of the last runs of the
+ * same engine on the same target. Returns the number of runs found. */
+size_t history_baseline(const char *path, const struct HistoryEntry *entry,
+                        uint64_t *throughput, uint64_t *fsync_p95) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+	    return 0;
+	}
+	uint64_t throughputs[HISTORY_BASELINE_RUNS];
+	uint64_t p95s[HISTORY_BASELINE_RUNS];
+	size_t n_runs = 0;
+	char line[512];
+	while (fgets(line, sizeof(line), f) != NULL) {
+	    unsigned version;
+	    char target[HISTORY_ID_SIZE];
+	    char engine[64];
+	    uint64_t bps, p95;
+	    if ((sscanf(line, "%u %*d %255s %63s %*u %*u %*u %" SCNu64 " %*u %" SCNu64,
+	                &version, target, engine, &bps, &p95) != 5) ||
+	        (version != HISTORY_VERSION) || (strcmp(target, entry->target) != 0) ||
+	        (strcmp(engine, entry->engine) != 0)) {
+	        continue;
+	    }
+	    /* ring buffer of the last runs */
+	    throughputs[n_runs % HISTORY_BASELINE_RUNS] = bps;
+	    p95s[n_runs % HISTORY_BASELINE_RUNS] = p95;
+	    n_runs++;
+	}
+	fclose(f);
+
+	size_t n = MIN(n_runs, (size_t) HISTORY_BASELINE_RUNS);
+	if (n > 0) {
+	    qsort(throughputs, n, sizeof(uint64_t), cmp_u64);
+	    qsort(p95s, n, sizeof(uint64_t), cmp_u64);
+	    *throughput = throughputs[n / 2];
+	    *fsync_p95 = p95s[n / 2];
+	}
+	return n;
+}
+
+/* Appends the entry to the history, dropping the oldest lines once there are
+ * too many of them. */
+bool history_append(const char *path, const struct HistoryEntry *entry) {
+	char line[512];
+	snprintf(line, sizeof(line),
+	         "%d %jd %s %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+	         " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+	         HISTORY_VERSION, (intmax_t) time(NULL), entry->target, entry->engine,
+	         entry->total_bytes, entry->bytes_written, entry->duration_us, entry->throughput,
+	         entry->fsync_p50, entry->fsync_p95, entry->fsync_p99);
+
+	/* Count the lines, rewriting the file is only needed once in a while. */
+	size_t n_lines = 0;
+	FILE *f = fopen(path, "r");
+	if (f != NULL) {
+	    int c;
+	    while ((c = fgetc(f)) != EOF) {
+	        n_lines += (c == '\n');
+	    }
+	}
+	if ((f != NULL) && (n_lines >= HISTORY_MAX_LINES)) {
+	    char tmp_path[PATH_MAX];
+	    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	    FILE *tmp = fopen(tmp_path, "w");
+	    if (tmp == NULL) {
+	        fclose(f);
+	        return false;
+	    }
+	    rewind(f);
+	    size_t skip = n_lines - HISTORY_MAX_LINES / 2;
+	    char buf[512];
+	    while (fgets(buf, sizeof(buf), f) != NULL) {
+	        if (skip > 0) {
+	            skip -= (strchr(buf, '\n') != NULL);
+	            continue;
+	        }
+	        fputs(buf, tmp);
+	    }
+	    fclose(f);
+	    fputs(line, tmp);
+	    /* The new file's data must be on disk before it replaces the old one. */
+	    bool ok = ((fflush(tmp) == 0) && (fsync(fileno(tmp)) == 0));
+	    ok = (fclose(tmp) == 0) && ok;
+	    ok = ok && (rename(tmp_path, path) == 0);
+	    if (!ok) {
+	        unlink(tmp_path);
+	    }
+	    return ok;
+	}
+	if (f != NULL) {
+	    fclose(f);
+	}
+
+	f = fopen(path, "a");
+	if (f == NULL) {
+	    return false;
+	}
+	fputs(line, f);
+	return (fclose(f) == 0);
+}
+
+#ifdef __linux__
+/* Same signature as sendfile() so that we can treat the same (see comment about
+ * splice() and sendfile() below). */
+ssize_t splice_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+	return splice(in_fd, 0, out_fd, 0, count, 0);
+}
+
+/* Opens a kernel crypto (AF_ALG) SHA-256 operation socket, returns -1 if not
+ * available. */
+int alg_sha256_open() {
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "hash",
+		.salg_name = "sha256",
+	};
+	int tfm_fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (tfm_fd == -1) {
+	    return -1;
+	}
+	int op_fd = -1;
+	if (bind(tfm_fd, (struct sockaddr *) &sa, sizeof(sa)) == 0) {
+	    op_fd = accept4(tfm_fd, NULL, NULL, SOCK_CLOEXEC);
+	}
+	close(tfm_fd);
+	return op_fd;
+}
+
+static bool splice_all(int in_fd, int out_fd, size_t len, unsigned int flags) {
+	while (len > 0) {
+	    ssize_t ret = splice(in_fd, NULL, out_fd, NULL, len, flags);
+	    if ((ret == -1) && (errno == EINTR)) {
+	        continue;
+	    }
+	    if (ret <= 0) {
+	        return false;
+	    }
+	    len -= ret;
+	}
+	return true;
+}
+
+/* Like the splice() path in main(), but also hashes the data without them ever
+ * entering user space. Every chunk of the input pipe is first duplicated with
+ * tee() into a pipe that is spliced into the AF_ALG socket alg_fd, and then the
+ * original is spliced into the target. */
+bool splice_hashed(int in_fd, int out_fd, size_t len, int alg_fd, size_t fsync_interval,
+                   struct Stats *stats, unsigned char digest[SHA256_DIGEST_SIZE], int *error) {
+	int hash_pipe[2];
+	if (pipe2(hash_pipe, O_CLOEXEC) == -1) {
+	    *error = errno;
+	    return false;
+	}
+	/* best effort, the bigger the pipe the fewer syscalls */
+	fcntl(hash_pipe[1], F_SETPIPE_SZ, BLOCK_SIZE);
+
+	size_t n_unsynced = 0;
+	bool success = true;
+	perf_phase(PHASE_WRITE);
+	while (success && (len > 0)) {
+	    stats_shm_publish(stats);
+	    ssize_t n_teed = tee(in_fd, hash_pipe[1], MIN(len, BLOCK_SIZE), 0);
+	    if ((n_teed == -1) && (errno == EINTR)) {
+	        continue;
+	    }
+	    if (n_teed <= 0) {
+	        if (n_teed == 0) {
+	            fprintf(stderr, "Unexpected end of input!\n");
+	        } else {
+	            *error = errno;
+	        }
+	        success = false;
+	        break;
+	    }
+	    if (!splice_all(in_fd, out_fd, n_teed, 0)) {
+	        fprintf(stderr, "Failed to write data: %m\n");
+	        *error = errno;
+	        success = false;
+	        break;
+	    }
+	    if (!splice_all(hash_pipe[0], alg_fd, n_teed, SPLICE_F_MORE)) {
+	        fprintf(stderr, "Failed to hash data: %m\n");
+	        *error = errno;
+	        success = false;
+	        break;
+	    }
+	    len -= n_teed;
+	    stats->total_bytes += n_teed;
+	    n_unsynced += n_teed;
+	    if ((fsync_interval != 0) && (n_unsynced >= fsync_interval)) {
+	        if (timed_fsync(out_fd, stats) == -1) {
+	            fprintf(stderr, "Failed to fsync data to target: %m\n");
+	            *error = errno;
+	            success = false;
+	            break;
+	        }
+	        n_unsynced = 0;
+	    }
+	}
+	/* like the other in-kernel copies, -f 0 still syncs once at the end */
+	if (success && (n_unsynced > 0) && (timed_fsync(out_fd, stats) == -1)) {
+	    fprintf(stderr, "Failed to fsync data to target: %m\n");
+	    *error = errno;
+	    success = false;
+	}
+
+	/* An empty message without MSG_MORE finalizes the hash. */
+	if (success &&
+	    ((send(alg_fd, NULL, 0, 0) == -1) ||
+	     (read(alg_fd, digest, SHA256_DIGEST_SIZE) != SHA256_DIGEST_SIZE))) {
+	    fprintf(stderr, "Failed to get the hash from the kernel: %m\n");
+	    *error = errno;
+	    success = false;
+	}
+	close(hash_pipe[0]);
+	close(hash_pipe[1]);
+	return success;
+}
+#endif  /* __linux__ */
+
+/***
+    Engines. Which one can be used depends on the input and the target, so
+    they are probed at start-up and the fastest usable engine is picked,
+    unless --engine says otherwise. From the fastest:
+
+        copy_file_range  in-kernel copy between regular files (a reflink or a
+                         server-side copy where the filesystem can do that)
+        sendfile         in-kernel copy from seekable input
+        splice           in-kernel copy from a pipe (with the hash computed
+                         by AF_ALG if a checksum is expected)
+        batch            user space, compared in --batch-size windows
+        user             user space, read(), compared and written per block
+
+    The in-kernel engines never let us see the data, so anything that needs
+    it (comparing, checkpoints, index verification, ...) rules them out.
+***/
+#define DEFAULT_BATCH_SIZE (16 * BLOCK_SIZE)   /* 16 MiB */
+
+enum Engine {
+	ENGINE_AUTO = 0,
+	ENGINE_USER,
+	ENGINE_BATCH,
+	ENGINE_SPLICE,
+	ENGINE_SENDFILE,
+	ENGINE_COPY_FILE_RANGE,
+};
+
+static const char *const engine_names[] = {
+	"auto", "user", "batch", "splice", "sendfile", "copy_file_range",
+};
+
+enum InputKind {
+	INPUT_FILE = 0,
+	INPUT_MEMFD,
+	INPUT_BLOCK,
+	INPUT_PIPE,
+	INPUT_SOCKET,
+	INPUT_OTHER,
+};
+
+static const char *const input_kind_names[] = {
+	"regular file", "memfd", "block device", "pipe", "socket", "other",
+};
+
+struct Probe {
+	enum InputKind in_kind;
+	bool io_uring;                /* not used by any engine (yet) */
+	bool copy_file_range;         /* accepted between the input and the target */
+	size_t direct_align;          /* O_DIRECT alignment of the target, 0 if not supported */
+	uint64_t discard_max;         /* bytes per discard, UINT64_MAX for hole punching */
+};
+
+static bool parse_engine(const char *name, enum Engine *engine) {
+	for (size_t i = 0; i < sizeof(engine_names) / sizeof(engine_names[0]); i++) {
+	    if (strcmp(name, engine_names[i]) == 0) {
+	        *engine = i;
+	        return true;
+	    }
+	}
+	return false;
+}
+
+#ifdef __linux__
+static enum InputKind probe_input_kind(int in_fd, const struct stat *in_stat) {
+	if (S_ISFIFO(in_stat->st_mode)) {
+	    return INPUT_PIPE;
+	} else if (S_ISSOCK(in_stat->st_mode)) {
+	    return INPUT_SOCKET;
+	} else if (S_ISBLK(in_stat->st_mode)) {
+	    return INPUT_BLOCK;
+	} else if (!S_ISREG(in_stat->st_mode)) {
+	    return INPUT_OTHER;
+	}
+	char path[64];
+	char link[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", in_fd);
+	ssize_t n = readlink(path, link, sizeof(link) - 1);
+	if (n > 0) {
+	    link[n] = '\0';
+	    if (strncmp(link, "/memfd:", strlen("/memfd:")) == 0) {
+	        return INPUT_MEMFD;
+	    }
+	}
+	return INPUT_FILE;
+}
+
+/* Max. bytes per BLKDISCARD from sysfs, partitions use their disk's queue. */
+static uint64_t probe_discard_max(const struct stat *out_stat) {
+	static const char *const candidates[] = {
+	    "queue/discard_max_bytes", "../queue/discard_max_bytes",
+	};
+	for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+	    char path[PATH_MAX];
+	    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s",
+	             major(out_stat->st_rdev), minor(out_stat->st_rdev), candidates[i]);
+	    FILE *f = fopen(path, "r");
+	    if (f == NULL) {
+	        continue;
+	    }
+	    uint64_t max = 0;
+	    bool ok = (fscanf(f, "%" SCNu64, &max) == 1);
+	    fclose(f);
+	    if (ok) {
+	        return max;
+	    }
+	}
+	return 0;
+}
+#endif  /* __linux__ */
+
+void probe_run(struct Probe *probe, int in_fd, const struct stat *in_stat, int out_fd,
+               const struct stat *out_stat, const char *out_path) {
+	memset(probe, 0, sizeof(*probe));
+	probe->in_kind = S_ISFIFO(in_stat->st_mode) ? INPUT_PIPE : INPUT_OTHER;
+#ifdef __linux__
+	probe->in_kind = probe_input_kind(in_fd, in_stat);
+
+#ifdef __NR_io_uring_setup
+	/* struct io_uring_params, <linux/io_uring.h> would clash with BLOCK_SIZE */
+	uint32_t params[30] = {0};
+	int ring_fd = syscall(__NR_io_uring_setup, 1, params);
+	if (ring_fd != -1) {
+	    probe->io_uring = true;
+	    close(ring_fd);
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	/* A zero-length copy only checks the file types and the open modes,
+	   copies across filesystems may still fail later (see copy_range()). */
+	probe->copy_file_range = (S_ISREG(in_stat->st_mode) && S_ISREG(out_stat->st_mode) &&
+	                          (copy_file_range(in_fd, NULL, out_fd, NULL, 0, 0) == 0));
+#endif
+
+	int direct_fd = open(out_path, O_RDONLY | O_DIRECT);
+	if (direct_fd != -1) {
+	    int sector_size = 0;
+	    if (S_ISBLK(out_stat->st_mode) && (ioctl(direct_fd, BLKSSZGET, &sector_size) == 0)) {
+	        probe->direct_align = sector_size;
+	    } else {
+	        probe->direct_align = out_stat->st_blksize;
+	    }
+	    close(direct_fd);
+	}
+
+	if (S_ISBLK(out_stat->st_mode)) {
+	    probe->discard_max = probe_discard_max(out_stat);
+	} else if (S_ISREG(out_stat->st_mode)) {
+	    probe->discard_max = UINT64_MAX;
+	}
+#else
+	(void) in_fd;
+	(void) out_fd;
+	(void) out_stat;
+	(void) out_path;
+#endif  /* __linux__ */
+}
+
+static void probe_print(const struct Probe *probe, const struct stat *out_stat) {
+	const char *target = S_ISBLK(out_stat->st_mode) ? "block device" :
+	                     (S_ISREG(out_stat->st_mode) ? "regular file" : "other");
+	fprintf(stderr, "engine: input %s, target %s\n", input_kind_names[probe->in_kind], target);
+	char discard[32];
+	if (probe->discard_max == UINT64_MAX) {
+	    snprintf(discard, sizeof(discard), "hole punching");
+	} else if (probe->discard_max > 0) {
+	    snprintf(discard, sizeof(discard), "%" PRIu64 " B max", probe->discard_max);
+	} else {
+	    snprintf(discard, sizeof(discard), "no");
+	}
+	fprintf(stderr, "engine: io_uring %s, copy_file_range %s, O_DIRECT alignment %zu, discard %s\n",
+	        probe->io_uring ? "yes" : "no", probe->copy_file_range ? "yes" : "no",
+	        probe->direct_align, discard);
+}
+
+/* Picks the engine for the probed input and target. need_data is why the
+ * data have to go through user space, NULL if they don't. Returns ENGINE_AUTO
+ * if the requested engine can't be used, the reason for that or for the
+ * choice made is put into why. */
+enum Engine engine_select(enum Engine requested, const struct Probe *probe, bool write_optimized,
+                          bool batch, const char *need_data, char *why, size_t why_size) {
+	bool pipe = (probe->in_kind == INPUT_PIPE);
+	bool seekable = ((probe->in_kind == INPUT_FILE) || (probe->in_kind == INPUT_MEMFD) ||
+	                 (probe->in_kind == INPUT_BLOCK));
+#ifndef __linux__
+	if (need_data == NULL) {
+	    need_data = "lack of in-kernel copies on this platform";
+	}
+#endif  /* __linux__ */
+
+	switch (requested) {
+	case ENGINE_AUTO:
+	    break;
+	case ENGINE_USER:
+	    snprintf(why, why_size, "forced by --engine");
+	    return ENGINE_USER;
+	case ENGINE_BATCH:
+	    if (!write_optimized) {
+	        snprintf(why, why_size, "it only works when comparing with the target");
+	        return ENGINE_AUTO;
 	    }
-	    ssize_t n_written = buf_io((io_fn_t)write, out_fd, buffer, n_read);
-	    if (n_written != n_read) {
-	        fprintf(stderr, "Failed to write data: %m\n");
-	        *error = errno;
-	        return false;
+	    snprintf(why, why_size, "forced by --engine");
+	    return ENGINE_BATCH;
+	default:
+	    if (need_data != NULL) {
+	        snprintf(why, why_size, "data must go through user space for %s", need_data);
+	        return ENGINE_AUTO;
+	    } else if ((requested == ENGINE_SPLICE) && !pipe) {
+	        snprintf(why, why_size, "the input is not a pipe");
+	        return ENGINE_AUTO;
+	    } else if ((requested == ENGINE_SENDFILE) && !seekable) {
+	        snprintf(why, why_size, "the input is not seekable");
+	        return ENGINE_AUTO;
+	    } else if ((requested == ENGINE_COPY_FILE_RANGE) && !probe->copy_file_range) {
+	        snprintf(why, why_size, "not supported between the input and the target");
+	        return ENGINE_AUTO;
 	    }
-		stats->total_bytes += n_read;
-	    stats->blocks_written++;
-	    stats->bytes_written += n_written;
-		if (fsync_interval != 0) {
-			n_unsynced += n_written;
-			if (n_unsynced >= fsync_interval) {
-				if (fsync(out_fd) == -1) {
-					fprintf(stderr, "warning: Failed to fsync data to target: %m\n");
-				}
-				n_unsynced = 0;
-			}
-		}
-	    len -= n_read;
+	    snprintf(why, why_size, "forced by --engine");
+	    return requested;
 	}
 
-	if ((fsync_interval != 0) && (n_unsynced >= fsync_interval)) {
-		if (fsync(out_fd) == -1) {
-			fprintf(stderr, "warning: Failed to fsync data to target: %m\n");
-		}
+	if (need_data != NULL) {
+	    snprintf(why, why_size, "data must go through user space for %s", need_data);
+	    return (batch && write_optimized) ? ENGINE_BATCH : ENGINE_USER;
+	} else if (pipe) {
+	    snprintf(why, why_size, "the input is a pipe");
+	    return ENGINE_SPLICE;
+	} else if (probe->copy_file_range) {
+	    snprintf(why, why_size, "both sides are regular files");
+	    return ENGINE_COPY_FILE_RANGE;
+	} else if (seekable) {
+	    snprintf(why, why_size, "the input is seekable");
+	    return ENGINE_SENDFILE;
 	}
-	return true;
+	snprintf(why, why_size, "the input (%s) can't be copied in the kernel",
+	         input_kind_names[probe->in_kind]);
+	return ENGINE_USER;
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/* Set once copy_range() has given up on copy_file_range(). */
+static bool copy_range_fell_back = false;
+
+/* Same signature as sendfile() so that we can treat the same. Filesystems that
+ * can't copy_file_range() between each other only tell at the first copy, the
+ * rest is then done by sendfile(). */
+ssize_t copy_range(int out_fd, int in_fd, off_t *offset, size_t count) {
+	if (!copy_range_fell_back) {
+	    ssize_t ret = copy_file_range(in_fd, NULL, out_fd, NULL, count, 0);
+	    if ((ret != -1) || ((errno != EXDEV) && (errno != EINVAL) &&
+	                        (errno != EOPNOTSUPP) && (errno != ENOSYS))) {
+	        return ret;
+	    }
+	    copy_range_fell_back = true;
+	}
+	return sendfile(out_fd, in_fd, offset, count);
 }
+#endif  /* HAVE_COPY_FILE_RANGE */
 
+/***
+    Discarding the target range before a full rewrite (--discard). Many
+    eMMC/SD controllers write faster to discarded blocks than to ones still
+    holding data, because the writes then don't trigger garbage collection.
+    Block devices get BLKDISCARD in chunks of at most discard_max_bytes (see
+    the probe), from regular files the range is punched out.
+***/
 #ifdef __linux__
-/* Same signature as sendfile() so that we can treat the same (see comment about
- * splice() and sendfile() below). */
-ssize_t splice_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
-	return splice(in_fd, 0, out_fd, 0, count, 0);
+/* sector size assumed if the probe couldn't get it */
+#define DISCARD_DEFAULT_ALIGN 512
+
+/* Discards len bytes of the target at offset, adds the number of bytes
+ * actually discarded to stats. */
+bool discard_target(int out_fd, const struct Probe *probe, const struct stat *out_stat,
+                    uint64_t offset, uint64_t len, struct Stats *stats) {
+	if (probe->discard_max == 0) {
+	    errno = EOPNOTSUPP;
+	    return false;
+	}
+	if (S_ISREG(out_stat->st_mode)) {
+	    if (fallocate(out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == -1) {
+	        return false;
+	    }
+	    stats->discards++;
+	    stats->bytes_discarded += len;
+	    return true;
+	}
+	/* whole (logical) sectors only, the partial ones at the ends are just
+	   written */
+	uint64_t align = (probe->direct_align > 0) ? probe->direct_align : DISCARD_DEFAULT_ALIGN;
+	uint64_t start = (offset + align - 1) / align * align;
+	uint64_t end = (offset + len) / align * align;
+	uint64_t chunk = MAX(probe->discard_max / align * align, align);
+	while (start < end) {
+	    uint64_t range[2] = { start, MIN(chunk, end - start) };
+	    if (ioctl(out_fd, BLKDISCARD, range) == -1) {
+	        return false;
+	    }
+	    stats->discards++;
+	    stats->bytes_discarded += range[1];
+	    start += range[1];
+	}
+	return true;
 }
 #endif  /* __linux__ */
 
 int main(int argc, char *argv[]) {
 	char *input_path = NULL;
+	char *input_paths[FRAMED_MAX_STREAMS];
+	size_t n_inputs = 0;
+	bool framed = false;
+	char *history_path = NULL;
+	bool use_perf_counters = false;
 	char *output_path = NULL;
 	uint64_t volume_size = 0;
 	bool write_optimized = true;
 	size_t fsync_interval = BLOCK_SIZE;
+	bool fixed_fsync_interval = false;
+	bool adapt_memory = false;
+	size_t ring_size = DEFAULT_RING_SIZE;
+	long long readahead_size = -1;   /* auto */
+	size_t erase_size = 0;
+	bool have_expected = false;
+	unsigned char expected[SHA256_DIGEST_SIZE];
+	char *checkpoint_path = NULL;
+	char *index_path = NULL;
+	bool io_throttle = false;
+	bool verbose = false;
+	size_t verify_count = 0;
+	double verify_fraction = 0.0;
+	size_t batch_size = 0;
+	enum Engine requested_engine = ENGINE_AUTO;
+	bool discard = false;
+	char *stats_shm_spec = NULL;
 
 	int option_index = 0;
-	int c = getopt_long(argc, argv, "hws:f:i:o:", long_options, &option_index);
+	int c = getopt_long(argc, argv, "hvws:f:i:o:", long_options, &option_index);
 	while (c != -1) {
 		switch (c) {
 		case 'h':
@@ -172,6 +3745,10 @@ int main(int argc, char *argv[]) {
 
 		case 'i':
 			input_path = optarg;
+			if (n_inputs < FRAMED_MAX_STREAMS) {
+				input_paths[n_inputs] = optarg;
+			}
+			n_inputs++;
 			break;
 
 		case 'o':
@@ -198,6 +3775,7 @@ int main(int argc, char *argv[]) {
 				return EXIT_FAILURE;
 			} else {
 				fsync_interval = ret;
+				fixed_fsync_interval = true;
 			}
 			break;
 		}
@@ -206,11 +3784,133 @@ int main(int argc, char *argv[]) {
 	        write_optimized = false;
 	        break;
 
+		case 'v':
+			verbose = true;
+			break;
+
+		case OPT_RING_SIZE: {
+			char *end = optarg;
+			long long ret = strtoll(optarg, &end, 10);
+			if ((ret < 0) || ((ret == 0) && (strcmp(optarg, "0") != 0)) || (*end != '\0')) {
+				fprintf(stderr, "Invalid ring size given: %s\n", optarg);
+				return EXIT_FAILURE;
+			} else {
+				ring_size = ret;
+			}
+			break;
+		}
+
+		case OPT_ERASE_SIZE: {
+			char *end = optarg;
+			long long ret = strtoll(optarg, &end, 10);
+			if ((ret <= 0) || (*end != '\0')) {
+				fprintf(stderr, "Invalid erase size given: %s\n", optarg);
+				return EXIT_FAILURE;
+			} else {
+				erase_size = ret;
+			}
+			break;
+		}
+
+		case OPT_EXPECT_SHA256:
+			if (!sha256_from_hex(optarg, expected)) {
+				fprintf(stderr, "Invalid SHA-256 checksum given: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			have_expected = true;
+			break;
+
+		case OPT_CHECKPOINT:
+			checkpoint_path = optarg;
+			break;
+
+		case OPT_READAHEAD: {
+			char *end = optarg;
+			long long ret = strtoll(optarg, &end, 10);
+			if ((ret < 0) || ((ret == 0) && (strcmp(optarg, "0") != 0)) || (*end != '\0')) {
+				fprintf(stderr, "Invalid read-ahead size given: %s\n", optarg);
+				return EXIT_FAILURE;
+			} else {
+				readahead_size = ret;
+			}
+			break;
+		}
+
+		case OPT_FRAMED:
+			framed = true;
+			break;
+
+		case OPT_HISTORY:
+			history_path = optarg;
+			break;
+
+		case OPT_PERF_COUNTERS:
+			use_perf_counters = true;
+			break;
+
+		case OPT_INDEX:
+			index_path = optarg;
+			break;
+
+		case OPT_IO_THROTTLE:
+			io_throttle = true;
+			break;
+
+		case OPT_ADAPT_MEMORY:
+			adapt_memory = true;
+			break;
+
+		case OPT_BATCH_SIZE: {
+			char *end = optarg;
+			long long ret = strtoll(optarg, &end, 10);
+			if ((ret < BLOCK_SIZE) || (*end != '\0')) {
+				fprintf(stderr, "Invalid batch size given: %s\n", optarg);
+				return EXIT_FAILURE;
+			} else {
+				batch_size = ret / BLOCK_SIZE * BLOCK_SIZE;
+			}
+			break;
+		}
+
+		case OPT_ENGINE:
+			if (!parse_engine(optarg, &requested_engine)) {
+				fprintf(stderr, "Invalid engine given: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case OPT_DISCARD:
+			discard = true;
+			break;
+
+		case OPT_STATS_SHM:
+			stats_shm_spec = optarg;
+			break;
+
+		case OPT_VERIFY_SAMPLE: {
+			char *end = optarg;
+			if (strchr(optarg, '.') != NULL) {
+				verify_fraction = strtod(optarg, &end);
+				if ((verify_fraction <= 0.0) || (verify_fraction > 1.0) || (*end != '\0')) {
+					fprintf(stderr, "Invalid verification sample given: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+			} else {
+				long long ret = strtoll(optarg, &end, 10);
+				if ((ret <= 0) || (*end != '\0')) {
+					fprintf(stderr, "Invalid verification sample given: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				verify_count = ret;
+			}
+			break;
+		}
+
 		default:
 			PrintHelp();
 			return EXIT_FAILURE;
 		}
-		c = getopt_long(argc, argv, "hws:i:o:", long_options, &option_index);
+		c = getopt_long(argc, argv, "hvws:f:i:o:", long_options, &option_index);
 	}
 
 	if ((input_path == NULL) || (output_path == NULL)) {
@@ -219,6 +3919,67 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
+	if ((n_inputs > 1) && !framed) {
+		fprintf(stderr, "Multiple inputs are only supported with --framed\n");
+		return EXIT_FAILURE;
+	}
+	if (n_inputs > FRAMED_MAX_STREAMS) {
+		fprintf(stderr, "Too many inputs given\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((checkpoint_path != NULL) && (fsync_interval == 0)) {
+		/* Only synced data can be recorded as written. */
+		fprintf(stderr, "Checkpoints require syncing (-f greater than 0)\n");
+		return EXIT_FAILURE;
+	}
+
+	if (framed) {
+		if (have_expected || (checkpoint_path != NULL) || (index_path != NULL)) {
+			fprintf(stderr, "Checksums, checkpoints and indexes are not supported with framed input\n");
+			return EXIT_FAILURE;
+		}
+		if (io_throttle) {
+			fprintf(stderr, "warning: I/O throttling is not supported with framed input\n");
+		}
+		if ((verify_count > 0) || (verify_fraction > 0.0)) {
+			fprintf(stderr, "warning: Sampled verification is not supported with framed input\n");
+		}
+		if (stats_shm_spec != NULL) {
+			fprintf(stderr, "warning: Live statistics are not supported with framed input\n");
+		}
+		if (erase_size != 0) {
+			fprintf(stderr, "warning: Wear accounting is not supported with framed input\n");
+		}
+		if (use_perf_counters) {
+			fprintf(stderr, "warning: Performance counters are not supported with framed input\n");
+		}
+		if (adapt_memory) {
+			fprintf(stderr, "warning: Memory adaptation is not supported with framed input\n");
+		}
+		return run_framed(input_paths, n_inputs, output_path, volume_size, write_optimized,
+		                  fsync_interval);
+	}
+
+	struct Index index = {0};
+	if (index_path != NULL) {
+		if (!index_load(&index, index_path)) {
+			fprintf(stderr, "Failed to load index '%s': %m\n", index_path);
+			return EXIT_FAILURE;
+		}
+		if (index.block_size != BLOCK_SIZE) {
+			fprintf(stderr, "Index block size %"PRIu32" not supported (must be %ld)\n",
+			        index.block_size, BLOCK_SIZE);
+			index_free(&index);
+			return EXIT_FAILURE;
+		}
+		if (have_expected && (memcmp(expected, index.fingerprint, SHA256_DIGEST_SIZE) != 0)) {
+			fprintf(stderr, "Index does not match the expected SHA-256 checksum\n");
+			index_free(&index);
+			return EXIT_FAILURE;
+		}
+	}
+
 	int in_fd;
 	int out_fd;
 	if (strcmp(input_path, "-") == 0) {
@@ -259,7 +4020,11 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
-	if (S_ISBLK(out_fd_stat.st_mode) && (major(out_fd_stat.st_rdev) == UBIMajorDevNo)) {
+	bool is_ubi = ubi_volume(&out_fd_stat);
+	/* Dynamic volumes can be updated LEB by LEB, only where they differ. */
+	struct UbiVolume ubi_vol;
+	bool ubi_diff = (write_optimized && ubi_dynamic_volume(&out_fd_stat, is_ubi, &ubi_vol));
+	if (is_ubi && !ubi_diff) {
 		int ret = ioctl(out_fd, UBI_IOCVOLUP, &volume_size);
 		if (ret == -1) {
 			close(in_fd);
@@ -273,6 +4038,8 @@ int main(int argc, char *argv[]) {
 	size_t len;
 	if (volume_size != 0) {
 		len = volume_size;
+	} else if ((in_fd_stat.st_size == 0) && (index_path != NULL)) {
+		len = index.image_size;
 	} else {
 		if (in_fd_stat.st_size == 0) {
 			fprintf(stderr, "Input size not specified and cannot be determined from stat()\n");
@@ -283,19 +4050,293 @@ int main(int argc, char *argv[]) {
 			len = in_fd_stat.st_size;
 		}
 	}
+	if ((index_path != NULL) && (len != index.image_size)) {
+		fprintf(stderr, "Input size %zu does not match the index (%ju)\n", len,
+		        (intmax_t) index.image_size);
+		close(in_fd);
+		close(out_fd);
+		return EXIT_FAILURE;
+	}
 
 	struct Stats stats = {0};
 	bool success = false;
 	int error = 0;
 
+	struct Sha256 hash;
+	if (have_expected) {
+		sha256_init(&hash);
+	}
+	struct Checkpoint checkpoint = { .path = checkpoint_path, .len = len,
+	                                 .have_expected = have_expected };
+	memcpy(checkpoint.expected, expected, SHA256_DIGEST_SIZE);
+	off_t resume_offset = 0;
+	if ((checkpoint_path != NULL) && (is_ubi || ubi_diff)) {
+		/* UBI_IOCVOLUP above has already started the update from scratch, a
+		   differential one is cheap to start over. */
+		unlink(checkpoint_path);
+	} else if ((checkpoint_path != NULL) &&
+	           checkpoint_load(&checkpoint, &resume_offset, have_expected ? &hash : NULL)) {
+		/* Non-seekable input is expected to start at the saved offset. */
+		bool seekable_input = (S_ISREG(in_fd_stat.st_mode) || S_ISBLK(in_fd_stat.st_mode));
+		if (!have_expected &&
+		    !checkpoint_verify(&checkpoint, seekable_input ? in_fd : -1, out_fd, resume_offset)) {
+			resume_offset = 0;
+		}
+		if ((seekable_input && (lseek(in_fd, resume_offset, SEEK_CUR) == -1)) ||
+		    (lseek(out_fd, resume_offset, SEEK_SET) == -1)) {
+			fprintf(stderr, "Failed to seek to the checkpoint offset %jd: %m\n",
+			        (intmax_t) resume_offset);
+			close(in_fd);
+			close(out_fd);
+			return EXIT_FAILURE;
+		}
+		len -= resume_offset;
+		stats.resumed_offset = resume_offset;
+	}
+
+	/* Blocks read back by --verify-sample are compared with the index or the
+	   input or, if neither is available, with CRCs taken while copying. */
+	bool verify_requested = ((verify_count > 0) || (verify_fraction > 0.0));
+	struct Verify verify = {
+		.in_fd = -1,
+		.image_size = len + resume_offset,
+		.index = (index_path != NULL) ? &index : NULL,
+	};
+	if (verify_requested && (is_ubi || ubi_diff)) {
+		fprintf(stderr, "warning: Sampled verification is not supported for UBI volumes\n");
+		verify_requested = false;
+	}
+	if (verify_requested && (index_path == NULL)) {
+		if (S_ISREG(in_fd_stat.st_mode) || S_ISBLK(in_fd_stat.st_mode)) {
+			verify.in_fd = in_fd;
+			verify.in_base = lseek(in_fd, 0, SEEK_CUR) - resume_offset;
+		} else {
+			verify.block_crcs = calloc((verify.image_size + BLOCK_SIZE - 1) / BLOCK_SIZE,
+			                           sizeof(uint32_t));
+			if (verify.block_crcs == NULL) {
+				fprintf(stderr, "Failed to allocate memory: %m\n");
+				close(in_fd);
+				close(out_fd);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	/* The in-kernel engines don't support write-optimized approach, hashing,
+	   checkpoints or index verification. Except for hashing of pipe input
+	   which can be done in the kernel too. */
+	const char *need_data = NULL;
+	if (write_optimized) {
+		need_data = "comparing with the target";
+	} else if (checkpoint_path != NULL) {
+		need_data = "checkpoints";
+	} else if (index_path != NULL) {
+		need_data = "index verification";
+	} else if (io_throttle) {
+		need_data = "I/O throttling";
+	} else if (verify.block_crcs != NULL) {
+		need_data = "read-back verification";
+	}
+	int alg_fd = -1;
+#ifdef __linux__
+	if ((need_data == NULL) && have_expected && S_ISFIFO(in_fd_stat.st_mode) &&
+	    ((requested_engine == ENGINE_AUTO) || (requested_engine == ENGINE_SPLICE))) {
+		alg_fd = alg_sha256_open();
+	}
+#endif  /* __linux__ */
+	if ((need_data == NULL) && have_expected && (alg_fd == -1)) {
+		need_data = "hashing the input";
+	}
+
+	struct Probe probe;
+	probe_run(&probe, in_fd, &in_fd_stat, out_fd, &out_fd_stat, output_path);
+	char why[128];
+	enum Engine engine_id = engine_select(requested_engine, &probe, write_optimized,
+	                                      (batch_size != 0), need_data, why, sizeof(why));
+	if (engine_id == ENGINE_AUTO) {
+		fprintf(stderr, "Engine '%s' cannot be used: %s\n", engine_names[requested_engine], why);
+		if (alg_fd != -1) {
+			close(alg_fd);
+		}
+		close(in_fd);
+		close(out_fd);
+		return EXIT_FAILURE;
+	}
+	if (verbose) {
+		probe_print(&probe, &out_fd_stat);
+		fprintf(stderr, "engine: %s (%s)\n", engine_names[engine_id], why);
+		if (ubi_diff) {
+			fprintf(stderr, "engine: changing only the differing LEBs (%zu bytes) of the dynamic UBI volume\n",
+			        ubi_vol.leb_size);
+		}
+	}
+	if ((engine_id != ENGINE_SPLICE) && (alg_fd != -1)) {
+		close(alg_fd);
+		alg_fd = -1;
+	}
+	bool user_space_copy = ((engine_id == ENGINE_USER) || (engine_id == ENGINE_BATCH));
+	if ((engine_id == ENGINE_BATCH) && (batch_size == 0)) {
+		batch_size = DEFAULT_BATCH_SIZE;
+	}
+	if ((erase_size != 0) && (!write_optimized || !user_space_copy || ubi_diff)) {
+		fprintf(stderr, "warning: Wear accounting (--erase-size) only applies to write-optimized"
+		        " copies through user space\n");
+		erase_size = 0;
+	}
+	verify.direct_align = probe.direct_align;
+	struct ShovelOptions shovel_opts = {
+		.write_optimized = write_optimized,
+		.fsync_interval = fsync_interval,
+		.erase_size = erase_size,
+		.hash = have_expected ? &hash : NULL,
+		.checkpoint = (checkpoint_path != NULL) ? &checkpoint : NULL,
+		.index = (index_path != NULL) ? &index : NULL,
+		.block_crcs = verify.block_crcs,
+	};
+
+	/* Done before the input is touched, the skips are then known up front. */
+	bool *planned = NULL;
+	if ((index_path != NULL) && write_optimized && !ubi_diff) {
+		planned = index_plan(&index, out_fd, resume_offset / BLOCK_SIZE, &stats);
+		if (planned == NULL) {
+			fprintf(stderr, "warning: Failed to compare the target with the index: %m\n");
+		}
+	}
+	shovel_opts.planned = planned;
+
+	struct Throttle throttle;
+	if (io_throttle) {
+		throttle_init(&throttle, &out_fd_stat, verbose);
+		shovel_opts.throttle = &throttle;
+	}
+
+	struct MemState mem_state;
+	if (adapt_memory && !mem_state_read(&mem_state)) {
+		fprintf(stderr, "warning: Memory pressure information not available\n");
+		adapt_memory = false;
+	}
+	shovel_opts.adapt_memory = adapt_memory;
+	shovel_opts.fixed_fsync_interval = fixed_fsync_interval;
+	shovel_opts.ring_size = ring_size;
+
+	/* The window needs two buffers (input and target), sized up front. */
+	if ((engine_id == ENGINE_BATCH) && !ubi_diff) {
+		unsigned int pct = adapt_memory ? mem_scale(&mem_state, 2 * batch_size + fsync_interval) : 100;
+		shovel_opts.batch_size = mem_scaled(batch_size, pct, BLOCK_SIZE) / BLOCK_SIZE * BLOCK_SIZE;
+	}
+
+	/* Only worth it if the data goes through user space and the other side of
+	   the pipe can make progress while we are blocked on the target. */
+	struct Ring *ring = NULL;
+	bool use_ring = (S_ISFIFO(in_fd_stat.st_mode) && (ring_size >= BLOCK_SIZE) && user_space_copy);
+	if (use_ring) {
+		unsigned int pct = adapt_memory ? mem_scale(&mem_state, ring_size + fsync_interval) : 100;
+		ring = ring_create(in_fd, len, ring_size, mem_scaled(ring_size, pct, 2 * BLOCK_SIZE));
+		if (ring == NULL) {
+			fprintf(stderr, "warning: Failed to set up input buffering: %m\n");
+			use_ring = false;
+		}
+	}
+	shovel_opts.ring = ring;
+
+	struct ReadAhead *readahead = NULL;
+	bool use_readahead = false;
+	if ((ring == NULL) && user_space_copy &&
+	    (S_ISREG(in_fd_stat.st_mode) || S_ISBLK(in_fd_stat.st_mode))) {
+		if (readahead_size < 0) {
+#ifdef __linux__
+			readahead_size = on_network_fs(in_fd) ? DEFAULT_READAHEAD_SIZE : 0;
+#else
+			readahead_size = 0;
+#endif  /* __linux__ */
+		}
+		use_readahead = (readahead_size >= BLOCK_SIZE);
+	}
+	if (use_readahead) {
+		unsigned int pct = adapt_memory ? mem_scale(&mem_state, readahead_size + fsync_interval) : 100;
+		readahead = readahead_create(in_fd, len, readahead_size,
+		                             mem_scaled(readahead_size, pct, 2 * BLOCK_SIZE));
+		if (readahead == NULL) {
+			fprintf(stderr, "warning: Failed to set up input read-ahead: %m\n");
+			use_readahead = false;
+		}
+	}
+	shovel_opts.readahead = readahead;
+	shovel_opts.readahead_size = use_readahead ? readahead_size : 0;
+
+	const char *engine = write_optimized ? "compare" : "copy";
+	if (ubi_diff) {
+		engine = "ubi-leb-change";
+	} else if (shovel_opts.batch_size != 0) {
+		engine = use_ring ? "batch+ring" : (use_readahead ? "batch+readahead" : "batch");
+	} else if (use_ring) {
+		engine = write_optimized ? "compare+ring" : "copy+ring";
+	} else if (use_readahead) {
+		engine = write_optimized ? "compare+readahead" : "copy+readahead";
+	}
+	if ((stats_shm_spec != NULL) && !stats_shm_open(stats_shm_spec, len, !write_optimized)) {
+		fprintf(stderr, "warning: Failed to set up live statistics in '%s': %m\n", stats_shm_spec);
+	}
+	stats_shm_publish(&stats);
+
+	/* Timed on its own, the writes are faster for it (or not). */
+	if (discard && (write_optimized || is_ubi)) {
+		fprintf(stderr, "warning: Discarding only applies to full rewrites (-w) of non-UBI targets\n");
+		discard = false;
+	}
+	if (discard) {
+#ifdef __linux__
+		uint64_t discard_start_us = now_us();
+		if (!discard_target(out_fd, &probe, &out_fd_stat, resume_offset, len, &stats)) {
+			fprintf(stderr, "warning: Failed to discard the target: %m\n");
+		}
+		stats.discard_us = now_us() - discard_start_us;
+		if (verbose) {
+			fprintf(stderr, "discard: %ju bytes in %zu requests, %ju ms\n",
+			        (intmax_t) stats.bytes_discarded, stats.discards,
+			        (intmax_t) (stats.discard_us / 1000));
+		}
+#else
+		fprintf(stderr, "warning: Discarding is not supported on this platform\n");
+#endif  /* __linux__ */
+	}
+
+	if (use_perf_counters && !perf_start()) {
+		fprintf(stderr, "warning: Performance counters not available: %m\n");
+		use_perf_counters = false;
+	}
+	uint64_t start_us = now_us();
+	stats_shm_phase(STATS_PHASE_COPYING, &stats);
+
+	/* The kernel copies below can only get the write-behind window sized up
+	   front. */
+	if (!user_space_copy && adapt_memory && !fixed_fsync_interval && (fsync_interval != 0)) {
+		unsigned int pct = mem_scale(&mem_state, fsync_interval);
+		mem_account(&stats, pct);
+		fsync_interval = mem_scaled(fsync_interval, pct, BLOCK_SIZE);
+	}
+
+	unsigned char digest[SHA256_DIGEST_SIZE];
 #ifndef __linux__
 	/* Nothing better available for non-Linux platforms (for now). */
-	success = shovel_data(in_fd, out_fd, len, write_optimized, fsync_interval, &stats, &error);
+	if (ubi_diff) {
+	    success = shovel_ubi(in_fd, out_fd, len, &ubi_vol, &shovel_opts, &stats, &error);
+	} else if (shovel_opts.batch_size != 0) {
+	    success = shovel_batched(in_fd, out_fd, len, &shovel_opts, &stats, &error);
+	} else {
+	    success = shovel_data(in_fd, out_fd, len, &shovel_opts, &stats, &error);
+	}
 #else  /* __linux__ */
-	/* The fancy syscalls below don't support write-optimized approach or
-	   syncing so we cannot use them for that. */
-	if (write_optimized) {
-	    success = shovel_data(in_fd, out_fd, len, write_optimized, fsync_interval, &stats, &error);
+	if (ubi_diff) {
+	    success = shovel_ubi(in_fd, out_fd, len, &ubi_vol, &shovel_opts, &stats, &error);
+	} else if (user_space_copy && (shovel_opts.batch_size != 0)) {
+	    success = shovel_batched(in_fd, out_fd, len, &shovel_opts, &stats, &error);
+	} else if (user_space_copy) {
+	    success = shovel_data(in_fd, out_fd, len, &shovel_opts, &stats, &error);
+	} else if (alg_fd != -1) {
+	    engine = "splice+alg";
+	    success = splice_hashed(in_fd, out_fd, len, alg_fd, fsync_interval, &stats, digest, &error);
+	    close(alg_fd);
 	} else {
 	    /***
 	    	On Linux the splice() and sendfile() syscalls can be useful for us (see
@@ -316,36 +4357,106 @@ int main(int argc, char *argv[]) {
 	    	mmap(2)-like operations (i.e., it cannot be a socket or a pipe).
 	    ***/
 	    ssize_t (*sendfile_fn)(int out_fd, int in_fd, off_t *offset, size_t count);
-	    if (S_ISFIFO(in_fd_stat.st_mode)) {
+	    if (engine_id == ENGINE_SPLICE) {
 	    	sendfile_fn = splice_sendfile;
+	    	engine = "splice";
+#ifdef HAVE_COPY_FILE_RANGE
+	    } else if (engine_id == ENGINE_COPY_FILE_RANGE) {
+	    	sendfile_fn = copy_range;
+	    	engine = "copy_file_range";
+#endif  /* HAVE_COPY_FILE_RANGE */
 	    } else {
 	    	sendfile_fn = sendfile;
+	    	engine = "sendfile";
 	    }
 
 	    if (fsync_interval == 0) {
 	    	fsync_interval = len;
 	    }
 	    ssize_t ret;
+	    /* a kernel copy doesn't publish progress, so it's kept short then */
+	    size_t chunk = (stats_shm.page != NULL) ? MIN(fsync_interval, STATS_COPY_CHUNK) : fsync_interval;
 	    size_t n_unsynced = 0;
+	    perf_phase(PHASE_WRITE);
 	    do {
-	    	ret = sendfile_fn(out_fd, in_fd, 0, MIN(len, fsync_interval));
+	    	stats_shm_publish(&stats);
+	    	ret = sendfile_fn(out_fd, in_fd, 0, MIN(len, chunk));
 	    	if (ret > 0) {
 	    	    len -= ret;
 	    	    stats.total_bytes += ret;
 	    	    n_unsynced += ret;
 	    	    if (n_unsynced >= fsync_interval) {
-	    	    	fsync(out_fd);
+	    	    	timed_fsync(out_fd, &stats);
 	    	    	n_unsynced = 0;
 	    	    }
 	    	}
 	    } while ((ret > 0) && (len > 0));
 	    success = ((ret == 0) || ((ret > 0) && (len == 0)));
 	    error = errno;
+#ifdef HAVE_COPY_FILE_RANGE
+	    if ((engine_id == ENGINE_COPY_FILE_RANGE) && copy_range_fell_back) {
+	    	engine = "sendfile";
+	    	if (verbose) {
+	    	    fprintf(stderr, "engine: copy_file_range failed at the first copy, used sendfile\n");
+	    	}
+	    }
+#endif  /* HAVE_COPY_FILE_RANGE */
 	}
 #endif  /* __linux__ */
 
+	uint64_t duration_us = now_us() - start_us;
+	perf_stop();
+
+	if (ring != NULL) {
+		stats.ring_high_water = (uint64_t) ring->high_water * BLOCK_SIZE;
+		stats.ring_stalls = ring->stalls;
+		ring_destroy(ring);
+	}
+	if (readahead != NULL) {
+		stats.readahead_inflight = readahead->peak_inflight;
+		stats.readahead_read_size = readahead->peak_read_blocks * BLOCK_SIZE;
+		stats.readahead_latency_us = readahead->latency_ewma_us;
+		stats.readahead_waits = readahead->consumer_waits;
+		readahead_destroy(readahead);
+	}
+
+	if (success && verify_requested) {
+		if (timed_fsync(out_fd, &stats) == -1) {
+			fprintf(stderr, "warning: Failed to fsync data to target: %m\n");
+		}
+		uint64_t first_block = (verify.block_crcs != NULL) ? resume_offset / BLOCK_SIZE : 0;
+		stats_shm_phase(STATS_PHASE_VERIFYING, &stats);
+		if (!verify_sampled(&verify, output_path, first_block, verify_count, verify_fraction)) {
+			fprintf(stderr, "Failed to verify the target: %m\n");
+			success = false;
+		} else if (verify.n_mismatches > 0) {
+			fprintf(stderr, "Verification failed: %zu of %zu sampled blocks differ, first at offset %ju\n",
+			        (size_t) verify.n_mismatches, verify.n_sample, (uintmax_t) verify.first_bad);
+			success = false;
+		}
+	}
+	free(verify.block_crcs);
+
 	close(in_fd);
 	close(out_fd);
+	free(planned);
+	index_free(&index);
+
+	char digest_hex[SHA256_HEX_SIZE] = "";
+	if (success && have_expected) {
+		if (alg_fd == -1) {
+			sha256_final(&hash, digest);
+		}
+		sha256_to_hex(digest, digest_hex);
+		if (memcmp(digest, expected, SHA256_DIGEST_SIZE) != 0) {
+			fprintf(stderr, "SHA-256 checksum mismatch: %s\n", digest_hex);
+			success = false;
+		}
+	}
+	if (success && (checkpoint_path != NULL)) {
+		unlink(checkpoint_path);
+	}
+	stats_shm_phase(success ? STATS_PHASE_DONE : STATS_PHASE_FAILED, &stats);
 
 	if (!success) {
 	    if (error != 0) {
@@ -355,19 +4466,141 @@ int main(int argc, char *argv[]) {
 	    	fprintf(stderr, "Failed to copy data\n");
 	    	printf("Total bytes written: %ju\n", (intmax_t) stats.total_bytes);
 	    }
+	    free(stats.fsync_us);
 	    return EXIT_FAILURE;
 	} else {
 	    if (write_optimized) {
 	        puts("================ STATISTICS ================");
-	        printf("Blocks written: %10zu\n", stats.blocks_written);
-	        printf("Blocks omitted: %10zu\n", stats.blocks_omitted);
+	        if (ubi_diff) {
+	            printf("LEBs changed: %12zu\n", stats.lebs_changed);
+	            printf("LEBs unchanged: %10zu\n", stats.lebs_unchanged);
+	            printf("LEBs unmapped: %11zu\n", stats.lebs_unmapped);
+	        } else {
+	            printf("Blocks written: %10zu\n", stats.blocks_written);
+	            printf("Blocks omitted: %10zu\n", stats.blocks_omitted);
+	        }
 	        printf("Bytes written: %11ju\n", (intmax_t) stats.bytes_written);
 	        printf("Total bytes: %13ju\n", (intmax_t) stats.total_bytes);
+	        if (use_ring) {
+	            printf("Ring high-water: %9ju\n", (intmax_t) stats.ring_high_water);
+	            printf("Ring stalls: %13zu\n", stats.ring_stalls);
+	        }
+	        if (use_readahead) {
+	            printf("Read-ahead depth: %8zu\n", stats.readahead_inflight);
+	            printf("Read-ahead size: %9zu\n", stats.readahead_read_size);
+	            printf("Read latency (us): %7ju\n", (intmax_t) stats.readahead_latency_us);
+	            printf("Read-ahead waits: %8zu\n", stats.readahead_waits);
+	        }
+	        if (shovel_opts.batch_size != 0) {
+	            printf("Batch size: %14zu\n", shovel_opts.batch_size);
+	        }
+	        if (cache_first_active()) {
+	            printf("Bytes from cache: %8ju\n", (intmax_t) stats.bytes_cached);
+	        }
+	        if (io_throttle) {
+	            printf("Throttle backoffs: %7zu\n", stats.throttle_backoffs);
+	            printf("Throttle ramp-ups: %7zu\n", stats.throttle_rampups);
+	            printf("Throttle min rate: %7ju\n", (intmax_t) stats.throttle_min_rate);
+	            printf("Throttle sleep (ms): %5ju\n", (intmax_t) (stats.throttle_sleep_us / 1000));
+	        }
+	        if (stats.mem_adapted && (stats.mem_pct_low < 100)) {
+	            printf("Memory budget low (%%): %3u\n", stats.mem_pct_low);
+	            printf("Memory trims: %12zu\n", stats.mem_trims);
+	        }
+	        if (erase_size != 0) {
+	            printf("Page-level bytes: %8ju\n", (intmax_t) stats.bytes_page_dirty);
+	            printf("EB-level bytes: %10ju\n", (intmax_t) stats.bytes_eb_dirty);
+	            printf("Erase blocks worn: %7ju\n", (intmax_t) stats.erase_blocks_worn);
+	        }
+	        if (checkpoint_path != NULL) {
+	            printf("Resumed from: %12ju\n", (intmax_t) stats.resumed_offset);
+	        }
+	        if (index_path != NULL) {
+	            printf("Blocks verified: %9zu\n", stats.blocks_verified);
+	            printf("Blocks pre-planned: %6zu\n", stats.blocks_planned);
+	        }
 	        puts("============================================");
 	    } else {
 	        printf("Total bytes written: %ju\n", (intmax_t) stats.total_bytes);
+	        if (use_ring) {
+	            printf("Ring high-water: %ju\n", (intmax_t) stats.ring_high_water);
+	            printf("Ring stalls: %zu\n", stats.ring_stalls);
+	        }
+	        if (discard) {
+	            printf("Bytes discarded: %ju\n", (intmax_t) stats.bytes_discarded);
+	            printf("Discard time (ms): %ju\n", (intmax_t) (stats.discard_us / 1000));
+	        }
+	        if (io_throttle) {
+	            printf("Throttle backoffs: %zu\n", stats.throttle_backoffs);
+	            printf("Throttle ramp-ups: %zu\n", stats.throttle_rampups);
+	            printf("Throttle min rate: %ju\n", (intmax_t) stats.throttle_min_rate);
+	            printf("Throttle sleep (ms): %ju\n", (intmax_t) (stats.throttle_sleep_us / 1000));
+	        }
+	    }
+	    if (have_expected) {
+	        printf("SHA-256: %s\n", digest_hex);
+	    }
+	    if (verify_requested) {
+	        uint64_t n = verify.n_population;
+	        printf("Verify sample: %zu of %ju blocks (%s)\n", verify.n_sample, (uintmax_t) n,
+	               verify.direct ? "direct I/O" : "page cache dropped");
+	        if (n == 0) {
+	            /* e.g. resumed from a checkpoint at the end of the image */
+	            puts("Verify confidence: nothing was written, nothing sampled");
+	        } else {
+	            uint64_t bound = verify_bound(n, verify.n_sample);
+	            printf("Verify confidence: 95%% that fewer than %ju blocks (%.2f%%) are bad\n",
+	                   (uintmax_t) bound, 100.0 * bound / n);
+	            printf("Verify detection of 1%% bad blocks: %.1f%%\n",
+	                   100.0 * (1.0 - verify_miss_chance(n, (n + 99) / 100, verify.n_sample)));
+	        }
+	    }
+	    if (use_perf_counters) {
+	        perf_print(stats.total_bytes);
+	    }
+	    if (history_path != NULL) {
+	        struct HistoryEntry entry = {
+	            .engine = engine,
+	            .total_bytes = stats.total_bytes,
+	            .bytes_written = (write_optimized ? stats.bytes_written : stats.total_bytes),
+	            .duration_us = duration_us,
+	            .throughput = stats.total_bytes * 1000000 / ((duration_us > 0) ? duration_us : 1),
+	        };
+	        target_identity(output_path, &out_fd_stat, entry.target);
+	        fsync_percentiles(&stats, &entry);
+
+	        uint64_t base_throughput = 0;
+	        uint64_t base_fsync_p95 = 0;
+	        size_t n_runs = history_baseline(history_path, &entry, &base_throughput, &base_fsync_p95);
+	        bool regression = false;
+	        if (n_runs >= HISTORY_MIN_BASELINE_RUNS) {
+	            regression = ((entry.throughput * 100 < base_throughput * (100 - HISTORY_REGRESSION_PCT)) ||
+	                          ((base_fsync_p95 > 0) && (entry.fsync_p95 > 2 * base_fsync_p95)));
+	        }
+	        printf("Engine: %s\n", engine);
+	        printf("Throughput (B/s): %ju\n", (intmax_t) entry.throughput);
+	        printf("Fsync latency p50/p95/p99 (us): %ju/%ju/%ju\n", (intmax_t) entry.fsync_p50,
+	               (intmax_t) entry.fsync_p95, (intmax_t) entry.fsync_p99);
+	        printf("Baseline runs: %zu\n", n_runs);
+	        if (n_runs > 0) {
+	            printf("Baseline throughput (B/s): %ju\n", (intmax_t) base_throughput);
+	            printf("Baseline fsync latency p95 (us): %ju\n", (intmax_t) base_fsync_p95);
+	        }
+	        if (n_runs < HISTORY_MIN_BASELINE_RUNS) {
+	            puts("Performance: no baseline yet");
+	        } else if (regression) {
+	            puts("Performance: REGRESSION");
+	            fprintf(stderr, "warning: Target '%s' is significantly slower than in the previous runs\n",
+	                    output_path);
+	        } else {
+	            puts("Performance: OK");
+	        }
+	        if (!history_append(history_path, &entry)) {
+	            fprintf(stderr, "warning: Failed to update history file '%s': %m\n", history_path);
+	        }
 	    }
 	}
+	free(stats.fsync_us);
 
 	return 0;
 }
@@ -0,0 +1,340 @@
+// Copyright 2023 Northern.tech AS
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/* Build-host companion of mender-flash: reads an image once and writes the
+ * index (see index.h) mender-flash uses to plan skips and verify the input. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "index.h"
+#include "sha256.h"
+
+#define DEFAULT_BLOCK_SIZE (1024*1024L)   /* 1 MiB, what mender-flash uses */
+#define DEFAULT_VERITY_BLOCK_SIZE 4096
+#define CHUNK_BLOCKS_PER_JOB 4
+#define MAX_JOBS 64
+
+#define MIN(X, Y) ((X < Y) ? X : Y)
+#define MAX(X, Y) ((X > Y) ? X : Y)
+
+/* dm-verity hashes full blocks, the image is zero-padded */
+static const unsigned char zeros[4096];
+
+static struct option long_options[] = {
+	{"help", no_argument, 0, 'h'},
+	{"input", required_argument, 0, 'i'},
+	{"output", required_argument, 0, 'o'},
+	{"block-size", required_argument, 0, 'b'},
+	{"jobs", required_argument, 0, 'j'},
+	{"verity-block-size", required_argument, 0, 'V'},
+	{0, 0, 0, 0}};
+
+void PrintHelp() {
+	fputs(
+		"Usage:\n"
+		"  mender-flash-index [-h|--help] [-b|--block-size <BYTES>] [-j|--jobs <N>] [-V|--verity-block-size <BYTES>] -i|--input <IMAGE_PATH> -o|--output <INDEX_PATH>\n"
+		"\n"
+		"  -b, --block-size          size of the indexed blocks (default: 1 MiB, as mender-flash)\n"
+		"  -j, --jobs                number of hashing threads (default: number of CPUs)\n"
+		"  -V, --verity-block-size   block size for the verity leaf hashes (default: 4096, 0 to omit)\n",
+		stderr);
+}
+
+/* One chunk of the image, hashed by all the jobs at once, each job taking
+ * every n_jobs-th block. */
+struct Chunk {
+	const unsigned char *data;
+	size_t len;
+	const struct Index *index;
+	uint64_t first_block;
+	uint64_t first_verity;
+	size_t n_jobs;
+};
+
+struct Job {
+	pthread_t thread;
+	const struct Chunk *chunk;
+	size_t id;
+};
+
+static void *hash_worker(void *arg) {
+	struct Job *job = arg;
+	const struct Chunk *chunk = job->chunk;
+	const struct Index *index = chunk->index;
+	size_t n_blocks = (chunk->len + index->block_size - 1) / index->block_size;
+	for (size_t i = job->id; i < n_blocks; i += chunk->n_jobs) {
+	    size_t start = i * index->block_size;
+	    size_t len = MIN(index->block_size, chunk->len - start);
+	    index_block_init(&index->blocks[chunk->first_block + i], chunk->data + start, len);
+	    if (index->verity_block_size == 0) {
+	        continue;
+	    }
+	    uint64_t leaf = chunk->first_verity + start / index->verity_block_size;
+	    for (size_t pos = 0; pos < len; pos += index->verity_block_size, leaf++) {
+	        size_t leaf_len = MIN(index->verity_block_size, len - pos);
+	        struct Sha256 ctx;
+	        sha256_init(&ctx);
+	        sha256_update(&ctx, chunk->data + start + pos, leaf_len);
+	        for (size_t pad = index->verity_block_size - leaf_len; pad > 0; ) {
+	            size_t n = MIN(pad, sizeof(zeros));
+	            sha256_update(&ctx, zeros, n);
+	            pad -= n;
+	        }
+	        sha256_final(&ctx, index->verity + leaf * SHA256_DIGEST_SIZE);
+	    }
+	}
+	return NULL;
+}
+
+static bool parse_size(const char *arg, long long *value) {
+	char *end;
+	errno = 0;
+	*value = strtoll(arg, &end, 10);
+	return ((errno == 0) && (*value >= 0) && (end != arg) && (*end == '\0'));
+}
+
+/* Makes room for n_blocks more blocks (and their verity leaves) in the index. */
+static bool grow_index(struct Index *index, uint64_t n_blocks, size_t *capacity) {
+	if (index->n_blocks + n_blocks <= *capacity) {
+	    return true;
+	}
+	size_t new_capacity = MAX(2 * *capacity, index->n_blocks + n_blocks);
+	struct IndexBlock *blocks = realloc(index->blocks, new_capacity * sizeof(*blocks));
+	if (blocks == NULL) {
+	    return false;
+	}
+	index->blocks = blocks;
+	if (index->verity_block_size != 0) {
+	    size_t leaves_per_block = index->block_size / index->verity_block_size;
+	    unsigned char *verity = realloc(index->verity,
+	                                    new_capacity * leaves_per_block * SHA256_DIGEST_SIZE);
+	    if (verity == NULL) {
+	        return false;
+	    }
+	    index->verity = verity;
+	}
+	*capacity = new_capacity;
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	char *input_path = NULL;
+	char *output_path = NULL;
+	long long block_size = DEFAULT_BLOCK_SIZE;
+	long long verity_block_size = DEFAULT_VERITY_BLOCK_SIZE;
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long long n_jobs = (n_cpus > 0) ? MIN(n_cpus, MAX_JOBS) : 1;
+
+	int option_index = 0;
+	int c;
+	while ((c = getopt_long(argc, argv, "hi:o:b:j:V:", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 'h':
+			PrintHelp();
+			return 0;
+
+		case 'i':
+			input_path = optarg;
+			break;
+
+		case 'o':
+			output_path = optarg;
+			break;
+
+		case 'b':
+			if (!parse_size(optarg, &block_size) || (block_size == 0) || (block_size > UINT32_MAX)) {
+				fprintf(stderr, "Invalid block size given: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'j':
+			if (!parse_size(optarg, &n_jobs) || (n_jobs == 0) || (n_jobs > MAX_JOBS)) {
+				fprintf(stderr, "Invalid number of jobs given: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'V':
+			if (!parse_size(optarg, &verity_block_size) || (verity_block_size > UINT32_MAX)) {
+				fprintf(stderr, "Invalid verity block size given: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		default:
+			PrintHelp();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ((input_path == NULL) || (output_path == NULL)) {
+		fprintf(stderr, "Wrong input parameters!\n");
+		PrintHelp();
+		return EXIT_FAILURE;
+	}
+	/* Each indexed block is split into whole verity blocks so that the jobs
+	   don't need to share any. */
+	if ((verity_block_size != 0) && (block_size % verity_block_size != 0)) {
+		fprintf(stderr, "Block size must be a multiple of the verity block size\n");
+		return EXIT_FAILURE;
+	}
+
+	int in_fd;
+	if (strcmp(input_path, "-") == 0) {
+		in_fd = STDIN_FILENO;
+	} else {
+		in_fd = open(input_path, O_RDONLY);
+		if (in_fd == -1) {
+			fprintf(stderr, "Failed to open '%s' for reading: %m\n", input_path);
+			return EXIT_FAILURE;
+		}
+	}
+
+	struct Index index = {
+		.block_size = block_size,
+		.verity_block_size = verity_block_size,
+	};
+	size_t capacity = 0;
+	size_t chunk_size = n_jobs * CHUNK_BLOCKS_PER_JOB * block_size;
+	unsigned char *chunk_buf = malloc(chunk_size);
+	struct Job jobs[MAX_JOBS];
+	if (chunk_buf == NULL) {
+		fprintf(stderr, "Failed to allocate memory: %m\n");
+		close(in_fd);
+		return EXIT_FAILURE;
+	}
+
+	/* The whole-image fingerprint has to be computed sequentially, this
+	   thread does it while the jobs hash the blocks of the same chunk. */
+	struct Sha256 fingerprint;
+	sha256_init(&fingerprint);
+	bool success = true;
+	ssize_t n_read;
+	do {
+		size_t len = 0;
+		do {
+			n_read = read(in_fd, chunk_buf + len, chunk_size - len);
+			if (n_read > 0) {
+				len += n_read;
+			}
+		} while (((n_read > 0) || ((n_read == -1) && (errno == EINTR))) && (len < chunk_size));
+		if (n_read == -1) {
+			fprintf(stderr, "Failed to read data: %m\n");
+			success = false;
+			break;
+		}
+		if (len == 0) {
+			break;
+		}
+
+		uint64_t n_blocks = (len + block_size - 1) / block_size;
+		if (!grow_index(&index, n_blocks, &capacity)) {
+			fprintf(stderr, "Failed to allocate memory: %m\n");
+			success = false;
+			break;
+		}
+		struct Chunk chunk = {
+			.data = chunk_buf,
+			.len = len,
+			.index = &index,
+			.first_block = index.n_blocks,
+			.first_verity = (verity_block_size != 0) ? index.image_size / verity_block_size : 0,
+			.n_jobs = n_jobs,
+		};
+		size_t n_started = 0;
+		for (; n_started < (size_t) n_jobs; n_started++) {
+			jobs[n_started].chunk = &chunk;
+			jobs[n_started].id = n_started;
+			if (pthread_create(&jobs[n_started].thread, NULL, hash_worker, &jobs[n_started]) != 0) {
+				break;
+			}
+		}
+		if (n_started == 0) {
+			/* no threads, no problem */
+			struct Job job = { .chunk = &chunk, .id = 0 };
+			chunk.n_jobs = 1;
+			hash_worker(&job);
+		} else if (n_started < (size_t) n_jobs) {
+			/* the missing jobs' blocks are done here */
+			for (size_t id = n_started; id < (size_t) n_jobs; id++) {
+				struct Job job = { .chunk = &chunk, .id = id };
+				hash_worker(&job);
+			}
+		}
+		sha256_update(&fingerprint, chunk_buf, len);
+		for (size_t i = 0; i < n_started; i++) {
+			pthread_join(jobs[i].thread, NULL);
+		}
+
+		index.n_blocks += n_blocks;
+		index.image_size += len;
+		/* a short chunk means end of input */
+	} while (n_read > 0);
+
+	free(chunk_buf);
+	close(in_fd);
+
+	if (success && (index.image_size == 0)) {
+		fprintf(stderr, "Empty input\n");
+		success = false;
+	}
+	if (success) {
+		sha256_final(&fingerprint, index.fingerprint);
+		if (verity_block_size != 0) {
+			index.n_verity = (index.image_size + verity_block_size - 1) / verity_block_size;
+		}
+		if (!index_build_extents(&index)) {
+			fprintf(stderr, "Failed to allocate memory: %m\n");
+			success = false;
+		}
+	}
+	if (success && !index_save(&index, output_path)) {
+		fprintf(stderr, "Failed to write index '%s': %m\n", output_path);
+		success = false;
+	}
+	if (!success) {
+		index_free(&index);
+		return EXIT_FAILURE;
+	}
+
+	size_t n_fill = 0;
+	size_t n_zero = 0;
+	for (uint64_t i = 0; i < index.n_blocks; i++) {
+		if (index.blocks[i].kind == INDEX_FILL) {
+			n_fill++;
+			n_zero += (index.blocks[i].fill == 0);
+		}
+	}
+	char fingerprint_hex[SHA256_HEX_SIZE];
+	sha256_to_hex(index.fingerprint, fingerprint_hex);
+	printf("Image size: %ju\n", (intmax_t) index.image_size);
+	printf("Blocks: %ju\n", (intmax_t) index.n_blocks);
+	printf("Fill blocks: %zu (%zu zero)\n", n_fill, n_zero);
+	printf("Extents: %ju\n", (intmax_t) index.n_extents);
+	printf("Verity leaves: %ju\n", (intmax_t) index.n_verity);
+	printf("SHA-256: %s\n", fingerprint_hex);
+	index_free(&index);
+	return 0;
+}
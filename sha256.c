@@ -0,0 +1,207 @@
+// Copyright 2023 Northern.tech AS
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+/* Plain FIPS 180-4 SHA-256, we don't want to depend on a crypto library just
+ * for this. */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(X, N) (((X) >> (N)) | ((X) << (32 - (N))))
+
+static void sha256_transform(uint32_t h[8], const unsigned char *block) {
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++) {
+		w[i] = ((uint32_t) block[4 * i] << 24) | ((uint32_t) block[4 * i + 1] << 16) |
+			((uint32_t) block[4 * i + 2] << 8) | (uint32_t) block[4 * i + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+	uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+	for (int i = 0; i < 64; i++) {
+		uint32_t S1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = hh + S1 + ch + K[i] + w[i];
+		uint32_t S0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = S0 + maj;
+		hh = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+	h[5] += f;
+	h[6] += g;
+	h[7] += hh;
+}
+
+void sha256_init(struct Sha256 *ctx) {
+	static const uint32_t H0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(ctx->h, H0, sizeof(H0));
+	ctx->n_bytes = 0;
+	ctx->buf_len = 0;
+}
+
+void sha256_update(struct Sha256 *ctx, const void *data, size_t len) {
+	const unsigned char *p = data;
+	ctx->n_bytes += len;
+	if (ctx->buf_len > 0) {
+		size_t n = SHA256_BLOCK_SIZE - ctx->buf_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(ctx->buf + ctx->buf_len, p, n);
+		ctx->buf_len += n;
+		p += n;
+		len -= n;
+		if (ctx->buf_len < SHA256_BLOCK_SIZE) {
+			return;
+		}
+		sha256_transform(ctx->h, ctx->buf);
+		ctx->buf_len = 0;
+	}
+	while (len >= SHA256_BLOCK_SIZE) {
+		sha256_transform(ctx->h, p);
+		p += SHA256_BLOCK_SIZE;
+		len -= SHA256_BLOCK_SIZE;
+	}
+	memcpy(ctx->buf, p, len);
+	ctx->buf_len = len;
+}
+
+void sha256_final(struct Sha256 *ctx, unsigned char digest[SHA256_DIGEST_SIZE]) {
+	uint64_t n_bits = ctx->n_bytes * 8;
+	ctx->buf[ctx->buf_len++] = 0x80;
+	if (ctx->buf_len > SHA256_BLOCK_SIZE - 8) {
+		memset(ctx->buf + ctx->buf_len, 0, SHA256_BLOCK_SIZE - ctx->buf_len);
+		sha256_transform(ctx->h, ctx->buf);
+		ctx->buf_len = 0;
+	}
+	memset(ctx->buf + ctx->buf_len, 0, SHA256_BLOCK_SIZE - 8 - ctx->buf_len);
+	for (int i = 0; i < 8; i++) {
+		ctx->buf[SHA256_BLOCK_SIZE - 1 - i] = (unsigned char) (n_bits >> (8 * i));
+	}
+	sha256_transform(ctx->h, ctx->buf);
+
+	for (int i = 0; i < 8; i++) {
+		digest[4 * i] = (unsigned char) (ctx->h[i] >> 24);
+		digest[4 * i + 1] = (unsigned char) (ctx->h[i] >> 16);
+		digest[4 * i + 2] = (unsigned char) (ctx->h[i] >> 8);
+		digest[4 * i + 3] = (unsigned char) ctx->h[i];
+	}
+}
+
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_SIZE]) {
+	struct Sha256 ctx;
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	sha256_final(&ctx, digest);
+}
+
+void sha256_to_hex(const unsigned char digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE]) {
+	for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+	}
+}
+
+static int hex_value(char c) {
+	if ((c >= '0') && (c <= '9')) {
+		return c - '0';
+	} else if ((c >= 'a') && (c <= 'f')) {
+		return c - 'a' + 10;
+	} else if ((c >= 'A') && (c <= 'F')) {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+static bool bytes_from_hex(const char *hex, unsigned char *bytes, size_t n_bytes) {
+	for (size_t i = 0; i < n_bytes; i++) {
+		int hi = hex_value(hex[2 * i]);
+		int lo = (hi < 0) ? -1 : hex_value(hex[2 * i + 1]);
+		if (lo < 0) {
+			return false;
+		}
+		bytes[i] = (unsigned char) ((hi << 4) | lo);
+	}
+	return true;
+}
+
+bool sha256_from_hex(const char *hex, unsigned char digest[SHA256_DIGEST_SIZE]) {
+	return ((strlen(hex) == 2 * SHA256_DIGEST_SIZE) &&
+	        bytes_from_hex(hex, digest, SHA256_DIGEST_SIZE));
+}
+
+void sha256_save(const struct Sha256 *ctx, char state[SHA256_STATE_SIZE]) {
+	char *p = state;
+	for (int i = 0; i < 8; i++) {
+		p += sprintf(p, "%08" PRIx32 " ", ctx->h[i]);
+	}
+	p += sprintf(p, "%" PRIu64 " ", ctx->n_bytes);
+	for (size_t i = 0; i < ctx->buf_len; i++) {
+		p += sprintf(p, "%02x", ctx->buf[i]);
+	}
+	*p = '\0';
+}
+
+bool sha256_load(struct Sha256 *ctx, const char *state) {
+	int n_chars = 0;
+	if (sscanf(state, "%8" SCNx32 " %8" SCNx32 " %8" SCNx32 " %8" SCNx32
+	           " %8" SCNx32 " %8" SCNx32 " %8" SCNx32 " %8" SCNx32 " %" SCNu64 "%n",
+	           &ctx->h[0], &ctx->h[1], &ctx->h[2], &ctx->h[3], &ctx->h[4], &ctx->h[5],
+	           &ctx->h[6], &ctx->h[7], &ctx->n_bytes, &n_chars) != 9) {
+		return false;
+	}
+	const char *buf_hex = state + n_chars;
+	if (*buf_hex == ' ') {
+		buf_hex++;
+	}
+	size_t hex_len = strlen(buf_hex);
+	ctx->buf_len = ctx->n_bytes % SHA256_BLOCK_SIZE;
+	if (hex_len != 2 * ctx->buf_len) {
+		return false;
+	}
+	return bytes_from_hex(buf_hex, ctx->buf, ctx->buf_len);
+}
@@ -0,0 +1,51 @@
+// Copyright 2023 Northern.tech AS
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#ifndef MENDER_FLASH_SHA256_H
+#define MENDER_FLASH_SHA256_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+/* Incremental SHA-256 context. All the fields are plain data so that the
+ * state can be saved and restored (see sha256_save() and sha256_load()). */
+struct Sha256 {
+	uint32_t h[8];
+	uint64_t n_bytes;
+	unsigned char buf[SHA256_BLOCK_SIZE];
+	size_t buf_len;
+};
+
+void sha256_init(struct Sha256 *ctx);
+void sha256_update(struct Sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct Sha256 *ctx, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+/* One-shot helper. */
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+void sha256_to_hex(const unsigned char digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE]);
+bool sha256_from_hex(const char *hex, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+/* Serializes the intermediate state into a single line of text (without a
+ * trailing newline) and back. */
+#define SHA256_STATE_SIZE (8 * 9 + 21 + 2 * SHA256_BLOCK_SIZE + 1)
+void sha256_save(const struct Sha256 *ctx, char state[SHA256_STATE_SIZE]);
+bool sha256_load(struct Sha256 *ctx, const char *state);
+
+#endif  /* MENDER_FLASH_SHA256_H */
@@ -0,0 +1,69 @@
+// Copyright 2023 Northern.tech AS
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+#ifndef MENDER_FLASH_STATS_PAGE_H
+#define MENDER_FLASH_STATS_PAGE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/***
+    Live statistics page, kept up to date by mender-flash (--stats-shm) in a
+    shared memory object for observers that want progress without parsing
+    any output. The page is updated under a sequence lock: seq is odd while an
+    update is in progress, so a consistent snapshot is read with
+
+        do {
+            s1 = atomic load (acquire) of seq;
+            copy the page;
+            atomic thread fence (acquire);
+            s2 = atomic load (relaxed) of seq;
+        } while ((s1 & 1) || (s1 != s2));
+
+    Readers never write to the page and never block the writer. All integers
+    are in host byte order, the layout only ever grows at the end (see size).
+***/
+
+#define STATS_PAGE_MAGIC "MFSTATS"
+#define STATS_PAGE_VERSION 1
+
+enum StatsPagePhase {
+	STATS_PHASE_STARTING = 0,
+	STATS_PHASE_COPYING = 1,
+	STATS_PHASE_SYNCING = 2,
+	STATS_PHASE_VERIFYING = 3,
+	STATS_PHASE_DONE = 4,
+	STATS_PHASE_FAILED = 5,
+};
+
+struct StatsPage {
+	char magic[8];                /* "MFSTATS\0" */
+	uint32_t version;             /* STATS_PAGE_VERSION */
+	uint32_t size;                /* sizeof(struct StatsPage) of the writer */
+	_Atomic uint64_t seq;         /* odd while an update is in progress */
+	uint32_t pid;                 /* of the writer */
+	uint32_t phase;               /* enum StatsPagePhase */
+	uint64_t total_size;          /* bytes to be copied by this run */
+	uint64_t total_bytes;         /* bytes copied (or compared) so far */
+	uint64_t bytes_written;
+	uint64_t blocks_written;
+	uint64_t blocks_omitted;
+	uint64_t resumed_offset;      /* from a checkpoint */
+	uint64_t n_fsyncs;
+	uint64_t elapsed_us;
+	uint64_t throughput;          /* B/s over the last second or so */
+	uint64_t eta_us;              /* 0 if not known (yet) */
+};
+
+#endif  /* MENDER_FLASH_STATS_PAGE_H */
@@ -14,8 +14,13 @@
 #    limitations under the License.
 
 MEN_FLASH="./mender-flash"
+MEN_FLASH_INDEX="./mender-flash-index"
+# built with TEST_HOOKS for the tests that need to fake their environment
+MEN_FLASH_TEST="./mender-flash-test"
 if [ $# -gt 1 ]; then
   MEN_FLASH="$1/mender-flash"
+  MEN_FLASH_INDEX="$1/mender-flash-index"
+  MEN_FLASH_TEST="$1/mender-flash-test"
 fi
 
 # whatever number that is unlikely to be returned by one of the tests by
@@ -61,6 +66,37 @@ help_test() {
   $MEN_FLASH -h 2> "${TEST_DIR}/help"
   echo 'Usage:' > "${TEST_DIR}/help.exp"
   echo '  mender-flash [-h|--help] [-w|--write-everything] [-s|--input-size <INPUT_SIZE>] [-f|--fsync-interval <FSYNC_INTERVAL>] -i|--input <INPUT_PATH> -o|--output <OUTPUT_PATH>' >> "${TEST_DIR}/help.exp"
+  echo '' >> "${TEST_DIR}/help.exp"
+  echo 'Advanced options:' >> "${TEST_DIR}/help.exp"
+  echo '  --ring-size <BYTES>       memory cap for buffering pipe input (0 to disable), only' >> "${TEST_DIR}/help.exp"
+  echo '                            used when the data pass through user space (not by splice)' >> "${TEST_DIR}/help.exp"
+  echo '  --erase-size <BYTES>      report write amplification and wear for this erase block size' >> "${TEST_DIR}/help.exp"
+  echo '  --expect-sha256 <HEX>     fail unless the SHA-256 checksum of the input matches' >> "${TEST_DIR}/help.exp"
+  echo '  --checkpoint <PATH>       save progress at every fsync and resume from it if it exists' >> "${TEST_DIR}/help.exp"
+  echo '                            (after comparing the input with the target, unless' >> "${TEST_DIR}/help.exp"
+  echo '                            --expect-sha256 is given)' >> "${TEST_DIR}/help.exp"
+  echo '                            (pipe input is expected to start at the saved offset)' >> "${TEST_DIR}/help.exp"
+  echo '  --readahead <BYTES>       memory cap for concurrent reads of seekable input' >> "${TEST_DIR}/help.exp"
+  echo '                            (default: 16 MiB on network filesystems, 0 to disable)' >> "${TEST_DIR}/help.exp"
+  echo '  --framed                  input is in the framed format, -i can be given multiple times' >> "${TEST_DIR}/help.exp"
+  echo '                            ("fd:N" reads from an inherited file descriptor)' >> "${TEST_DIR}/help.exp"
+  echo '  --history <PATH>          append a summary of the run to this file and compare it with' >> "${TEST_DIR}/help.exp"
+  echo '                            the previous runs on the same target' >> "${TEST_DIR}/help.exp"
+  echo '  --perf-counters           report hardware performance counters per GiB and phase' >> "${TEST_DIR}/help.exp"
+  echo '  --index <PATH>            verify the input against an index made by mender-flash-index' >> "${TEST_DIR}/help.exp"
+  echo '                            and compare the target with it before any input arrives' >> "${TEST_DIR}/help.exp"
+  echo '  --io-throttle             slow writing down while other tasks are stalling on I/O' >> "${TEST_DIR}/help.exp"
+  echo '  --verify-sample <N|FRACTION>  read back this many (or this fraction of) random blocks' >> "${TEST_DIR}/help.exp"
+  echo '                            after the final sync and compare them with the input' >> "${TEST_DIR}/help.exp"
+  echo '  --batch-size <BYTES>      compare and write in windows of this size (e.g. 16-64 MiB)' >> "${TEST_DIR}/help.exp"
+  echo '  --engine <NAME>           auto (default, the fastest one usable), user, batch, splice,' >> "${TEST_DIR}/help.exp"
+  echo '                            sendfile or copy_file_range' >> "${TEST_DIR}/help.exp"
+  echo '  --discard                 discard the target range before rewriting it (with -w)' >> "${TEST_DIR}/help.exp"
+  echo '  --stats-shm <NAME|fd:N>   keep live statistics in this shared memory object (or in' >> "${TEST_DIR}/help.exp"
+  echo '                            an inherited memfd), see stats_page.h' >> "${TEST_DIR}/help.exp"
+  echo '  --adapt-memory            shrink the input buffers and, unless -f is given, the' >> "${TEST_DIR}/help.exp"
+  echo '                            write-behind window under memory pressure' >> "${TEST_DIR}/help.exp"
+  echo '  -v|--verbose              trace adaptive decisions to stderr' >> "${TEST_DIR}/help.exp"
   ret=0
   diff "${TEST_DIR}/help" "${TEST_DIR}/help.exp" > /dev/null || ret=1
   if [ $ret = 1 ]; then
@@ -186,6 +222,67 @@ double_write_with_defaults_test() {
   return $ret
 }
 
+cached_compare_test() {
+  local n_bytes=$((BLOCK * 2))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+
+  # the first run leaves the target in the page cache
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    $MEN_FLASH -i "$input" -o "$output" > /dev/null &&
+    $MEN_FLASH -i "$input" -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Blocks omitted:\s\+2\$" "$stats" >/dev/null || { echo "Wrong 'Blocks omitted' stats" && ret=1; }
+    grep "Bytes from cache:\s\+[0-9]\+\$" "$stats" >/dev/null || { echo "Wrong 'Bytes from cache' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  return $ret
+}
+
+readahead_write_test() {
+  local n_bytes=$((BLOCK * 7 + 1000))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    $MEN_FLASH -i "$input" -o "$output" > /dev/null &&
+    dd if=/dev/urandom of="$input" bs=$BLOCK count=2 seek=3 conv=notrunc >/dev/null 2>&1 &&
+    $MEN_FLASH --readahead $((BLOCK * 3)) -i "$input" -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Total bytes:\s\+$n_bytes\$" "$stats" >/dev/null || { echo "Wrong 'Total bytes' stats" && ret=1; }
+    grep "Blocks written:\s\+2\$" "$stats" >/dev/null || { echo "Wrong 'Blocks written' stats" && ret=1; }
+    grep "Read-ahead depth:\s\+[0-9]\+\$" "$stats" >/dev/null || { echo "Wrong 'Read-ahead depth' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  return $ret
+}
+
 basic_write_with_no_sync_test() {
   local n_bytes=$((BLOCK * 3))
   local input="${TEST_DIR}/test.img"
@@ -564,6 +661,95 @@ pipe_partial_match_write_everything_test() {
   return $ret
 }
 
+pipe_ring_write_test() {
+  local n_bytes=$((BLOCK * 5))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    cat "$input" | $MEN_FLASH --ring-size $((BLOCK * 3)) --input-size $n_bytes -i - -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Bytes written:\s\+$n_bytes\$" "$stats" >/dev/null || { echo "Wrong 'Bytes written' stats" && ret=1; }
+    # 3 MiB is rounded down to 2 slots
+    grep "Ring high-water:\s\+\($BLOCK\|$((BLOCK * 2))\)\$" "$stats" >/dev/null || { echo "Wrong 'Ring high-water' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  return $ret
+}
+
+pipe_ring_stop_test() {
+  local n_bytes=$((BLOCK * 4))
+  local input="${TEST_DIR}/test.img"
+  local other="${TEST_DIR}/other.img"
+  local index="${TEST_DIR}/test.idx"
+  local fifo="${TEST_DIR}/test.fifo"
+  local output="${TEST_DIR}/test.out"
+
+  which timeout >/dev/null || return $SKIP_EXIT_CODE
+
+  # the input stalls after the first (mismatching) block, the ring's reader
+  # must still be stopped
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    dd if=/dev/urandom of="$other" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    $MEN_FLASH_INDEX -i "$other" -o "$index" >/dev/null &&
+    mkfifo "$fifo"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    { head -c $BLOCK "$input"; sleep 30; } > "$fifo" &
+    local writer=$!
+    timeout 10 $MEN_FLASH --index "$index" -s $n_bytes -i "$fifo" -o "$output" >/dev/null 2>&1
+    local flash_ret=$?
+    kill $writer 2>/dev/null
+    wait $writer 2>/dev/null
+    [ $flash_ret = 124 ] && { echo "Hung on stalled input" && ret=1; }
+    [ $flash_ret = 0 ] && { echo "Mismatch not detected" && ret=1; }
+  fi
+
+  rm -f "$input" "$other" "$index" "$fifo" "$output"
+  return $ret
+}
+
+pipe_no_ring_write_test() {
+  local n_bytes=$((BLOCK * 2))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    cat "$input" | $MEN_FLASH --ring-size 0 --input-size $n_bytes -i - -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Ring" "$stats" >/dev/null && { echo "Unexpected 'Ring' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  return $ret
+}
+
 pipe_write_no_size_test() {
   local n_bytes=$BLOCK
   local input="${TEST_DIR}/test.img"
@@ -711,6 +897,35 @@ bad_sync_interval_test() {
   return $ret
 }
 
+late_sync_interval_test() {
+  local n_bytes=$((BLOCK * 2))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local checkpoint="${TEST_DIR}/checkpoint"
+  local err_out="${TEST_DIR}/err_out"
+
+  # -f is an option like any other, not only as the first one
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    $MEN_FLASH -v -w -i "$input" -o "$output" -f 0 >/dev/null 2> "$err_out"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+  else
+    cat "$err_out"
+  fi
+
+  # and it is taken into account there
+  if [ $ret = 0 ]; then
+    $MEN_FLASH --checkpoint "$checkpoint" -i "$input" -o "$output" -f 0 >/dev/null 2> "$err_out" &&
+      { echo "Checkpoint without syncing accepted" && ret=1; }
+    grep "Checkpoints require syncing" "$err_out" >/dev/null || { echo "Wrong error message" && cat "$err_out" && ret=1; }
+  fi
+
+  rm -f "$input" "$output" "$checkpoint" "$err_out"
+  return $ret
+}
+
 bad_size_test() {
   local n_bytes=$BLOCK
   local input="${TEST_DIR}/test.out"
@@ -829,6 +1044,1037 @@ partial_match_in_the_middle_block_overlap_test() {
   return $ret
 }
 
+wear_stats_test() {
+  local n_bytes=$((BLOCK * 2))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+
+  # change one page in the second block
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    $MEN_FLASH -i "$input" -o "$output" > /dev/null &&
+    dd if=/dev/urandom of="$input" bs=4096 count=1 seek=$((BLOCK / 4096 + 2)) conv=notrunc >/dev/null 2>&1 &&
+    $MEN_FLASH --erase-size $((BLOCK / 2)) -i "$input" -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Bytes written:\s\+$BLOCK\$" "$stats" >/dev/null || { echo "Wrong 'Bytes written' stats" && ret=1; }
+    grep "Page-level bytes:\s\+4096\$" "$stats" >/dev/null || { echo "Wrong 'Page-level bytes' stats" && ret=1; }
+    grep "EB-level bytes:\s\+$((BLOCK / 2))\$" "$stats" >/dev/null || { echo "Wrong 'EB-level bytes' stats" && ret=1; }
+    grep "Erase blocks worn:\s\+2\$" "$stats" >/dev/null || { echo "Wrong 'Erase blocks worn' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  # no wear accounting for full rewrites
+  if [ $ret = 0 ]; then
+    $MEN_FLASH -w --erase-size $((BLOCK / 2)) -i "$input" -o "$output" > "$stats" 2>&1 || ret=1
+    grep "warning: Wear accounting" "$stats" >/dev/null || { echo "No warning for --erase-size with -w" && ret=1; }
+    grep "EB-level bytes:" "$stats" >/dev/null && { echo "Unexpected wear stats with -w" && ret=1; }
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  return $ret
+}
+
+expect_sha256_test() {
+  local n_bytes=$((BLOCK * 3 + 1000))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+
+  which sha256sum >/dev/null || return $SKIP_EXIT_CODE
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1
+  local sum=$(sha256sum "$input" | cut -d' ' -f1)
+  $MEN_FLASH -w --expect-sha256 $sum -i "$input" -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "SHA-256: $sum\$" "$stats" >/dev/null || { echo "Wrong 'SHA-256' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  return $ret
+}
+
+pipe_expect_sha256_write_everything_test() {
+  local n_bytes=$((BLOCK * 3 + 1000))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+
+  which sha256sum >/dev/null || return $SKIP_EXIT_CODE
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1
+  local sum=$(sha256sum "$input" | cut -d' ' -f1)
+  cat "$input" | $MEN_FLASH -w --expect-sha256 $sum --input-size $n_bytes -i - -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Total bytes written: $n_bytes\$" "$stats" >/dev/null || { echo "Wrong 'Total bytes' stats" && ret=1; }
+    grep "SHA-256: $sum\$" "$stats" >/dev/null || { echo "Wrong 'SHA-256' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  return $ret
+}
+
+pipe_hashed_splice_sync_test() {
+  local n_bytes=$((BLOCK * 3))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local trace="${TEST_DIR}/test.trace"
+  local name="mender-flash-test-$$"
+  local page="/dev/shm/$name"
+
+  which sha256sum >/dev/null || return $SKIP_EXIT_CODE
+  [ -d /dev/shm ] || return $SKIP_EXIT_CODE
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1
+  local sum=$(sha256sum "$input" | cut -d' ' -f1)
+
+  # even without periodic syncing, the hashed splice syncs once at the end
+  cat "$input" | $MEN_FLASH -v -w --fsync-interval 0 --expect-sha256 $sum --stats-shm "$name" \
+    -s $n_bytes -i - -o "$output" > /dev/null 2> "$trace"
+  ret=$?
+
+  if [ $ret = 0 ] && ! grep "^engine: splice " "$trace" >/dev/null; then
+    # no AF_ALG hashing in the kernel, the data go through user space
+    rm -f "$input" "$output" "$trace" "$page"
+    return $SKIP_EXIT_CODE
+  fi
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    [ $(od -An -t u8 -j 80 -N 8 "$page") -ge 1 ] || { echo "Target never synced" && ret=1; }
+  else
+    cat "$trace"
+  fi
+
+  rm -f "$input" "$output" "$trace" "$page"
+  return $ret
+}
+
+expect_sha256_mismatch_test() {
+  local n_bytes=$BLOCK
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local err_out="${TEST_DIR}/err_out"
+  local sum=0000000000000000000000000000000000000000000000000000000000000000
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    $MEN_FLASH --expect-sha256 $sum -i "$input" -o "$output" > /dev/null 2> "$err_out"
+  if [ $? = 1 ]; then
+    # we actually want to see a failure here
+    ret=0
+  else
+    ret=1
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "SHA-256 checksum mismatch" "$err_out" >/dev/null || { echo "Wrong error message" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$err_out"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$err_out"
+  return $ret
+}
+
+pipe_checkpoint_resume_test() {
+  local n_bytes=$((BLOCK * 4))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+  local checkpoint="${TEST_DIR}/checkpoint"
+
+  which sha256sum >/dev/null || return $SKIP_EXIT_CODE
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1
+  local sum=$(sha256sum "$input" | cut -d' ' -f1)
+
+  # the input is cut short after 2 MiB, then the rest arrives
+  head -c $((BLOCK * 2 + 1000)) "$input" |
+    $MEN_FLASH --checkpoint "$checkpoint" --expect-sha256 $sum --input-size $n_bytes -i - -o "$output" >/dev/null 2>&1
+  tail -c +$((BLOCK * 2 + 1)) "$input" |
+    $MEN_FLASH --checkpoint "$checkpoint" --expect-sha256 $sum --input-size $n_bytes -i - -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Resumed from:\s\+$((BLOCK * 2))\$" "$stats" >/dev/null || { echo "Wrong 'Resumed from' stats" && ret=1; }
+    grep "Total bytes:\s\+$((BLOCK * 2))\$" "$stats" >/dev/null || { echo "Wrong 'Total bytes' stats" && ret=1; }
+    grep "SHA-256: $sum\$" "$stats" >/dev/null || { echo "Wrong 'SHA-256' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+  if [ -e "$checkpoint" ]; then
+    echo "Checkpoint not removed"
+    ret=1
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  rm -f "$checkpoint"
+  return $ret
+}
+
+checkpoint_resume_test() {
+  local n_bytes=$((BLOCK * 3))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+  local checkpoint="${TEST_DIR}/checkpoint"
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1
+  head -c $((BLOCK + 10)) "$input" |
+    $MEN_FLASH -w --checkpoint "$checkpoint" --input-size $n_bytes -i - -o "$output" >/dev/null 2>&1
+  $MEN_FLASH --checkpoint "$checkpoint" -i "$input" -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Resumed from:\s\+$BLOCK\$" "$stats" >/dev/null || { echo "Wrong 'Resumed from' stats" && ret=1; }
+    grep "Total bytes:\s\+$((BLOCK * 2))\$" "$stats" >/dev/null || { echo "Wrong 'Total bytes' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  rm -f "$checkpoint"
+  return $ret
+}
+
+checkpoint_mismatch_test() {
+  local n_bytes=$((BLOCK * 3))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+  local checkpoint="${TEST_DIR}/checkpoint"
+
+  # a checkpoint of another image of the same size must not be resumed from
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1
+  head -c $((BLOCK + 10)) /dev/urandom |
+    $MEN_FLASH -w --checkpoint "$checkpoint" --input-size $n_bytes -i - -o "$output" >/dev/null 2>&1
+  $MEN_FLASH --checkpoint "$checkpoint" -i "$input" -o "$output" > "$stats" 2>&1
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+    grep "warning: Ignoring checkpoint" "$stats" >/dev/null || { echo "Checkpoint not ignored" && ret=1; }
+    grep "Resumed from:\s\+0\$" "$stats" >/dev/null || { echo "Resumed from a wrong checkpoint" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  # only synced data can be checkpointed
+  if [ $ret = 0 ]; then
+    $MEN_FLASH -f 0 --checkpoint "$checkpoint" -i "$input" -o "$output" >/dev/null 2>&1 &&
+      { echo "Checkpoint without syncing accepted" && ret=1; }
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  rm -f "$checkpoint"
+  return $ret
+}
+
+# Splits a 6 MiB image into two framed streams, blocks 2, 4 and 5 are expected
+# to be zeros, 0xAB bytes and already on the target respectively.
+# $1 - image, $2 and $3 - output streams, $4 - "corrupt", "incomplete", "flags" or ""
+make_framed_streams() {
+  python3 - "$@" <<'PYEOF'
+import struct, sys, zlib
+image, out_a, out_b = sys.argv[1:4]
+mode = sys.argv[4] if len(sys.argv) > 4 else ""
+BLOCK = 1048576
+data = open(image, "rb").read()
+
+def record(rtype, offset, length, fill=0, payload=b"", flags=0):
+    header = struct.pack("<IHHQQII", 0x4352464D, rtype, flags, offset, length, fill, 0)
+    crc = zlib.crc32(payload, zlib.crc32(header))
+    return header[:28] + struct.pack("<I", crc) + payload
+
+def stream(records):
+    return b"MFFRAMED" + struct.pack("<IIQ", 1, 0, len(data)) + b"".join(records)
+
+half = BLOCK // 2
+a = []
+for block in (3, 1, 0):
+    for off in (block * BLOCK + half, block * BLOCK):
+        a.append(record(1, off, half, payload=data[off:off + half]))
+if mode == "corrupt":
+    a[1] = a[1][:40] + bytes([a[1][40] ^ 0xFF]) + a[1][41:]
+if mode == "incomplete":
+    a.pop()
+if mode == "flags":
+    a[1] = record(1, 3 * BLOCK, half, payload=data[3 * BLOCK:3 * BLOCK + half], flags=1)
+a.append(record(5, 0, 0))
+b = [record(2, 2 * BLOCK, BLOCK), record(3, 4 * BLOCK, BLOCK, fill=0xAB),
+     record(4, 5 * BLOCK, BLOCK), record(5, 0, 0)]
+open(out_a, "wb").write(stream(a))
+open(out_b, "wb").write(stream(b))
+PYEOF
+}
+
+make_framed_image() {
+  local image="$1"
+  local target="$2"
+  local fill="${TEST_DIR}/fill"
+
+  head -c $BLOCK /dev/zero | tr '\0' '\253' > "$fill" &&
+    dd if=/dev/urandom of="$image" bs=$BLOCK count=6 >/dev/null 2>&1 &&
+    dd if=/dev/zero of="$image" bs=$BLOCK count=1 seek=2 conv=notrunc >/dev/null 2>&1 &&
+    dd if="$fill" of="$image" bs=$BLOCK count=1 seek=4 conv=notrunc >/dev/null 2>&1 &&
+    cp "$image" "$target" &&
+    dd if=/dev/urandom of="$target" bs=$BLOCK count=5 conv=notrunc >/dev/null 2>&1
+  ret=$?
+  rm -f "$fill"
+  return $ret
+}
+
+framed_write_test() {
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+  local stream_a="${TEST_DIR}/stream_a"
+  local stream_b="${TEST_DIR}/stream_b"
+
+  which python3 >/dev/null || return $SKIP_EXIT_CODE
+
+  make_framed_image "$input" "$output" &&
+    make_framed_streams "$input" "$stream_a" "$stream_b" &&
+    cat "$stream_a" | $MEN_FLASH --framed -i - -i "$stream_b" -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    diff "$input" "$output" >/dev/null || { echo "Input and output differ" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Total bytes:\s\+$((BLOCK * 6))\$" "$stats" >/dev/null || { echo "Wrong 'Total bytes' stats" && ret=1; }
+    grep "Streams:\s\+2\$" "$stats" >/dev/null || { echo "Wrong 'Streams' stats" && ret=1; }
+    grep "Records:\s\+11\$" "$stats" >/dev/null || { echo "Wrong 'Records' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  rm -f "$stream_a"
+  rm -f "$stream_b"
+  return $ret
+}
+
+framed_corrupt_test() {
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local err_out="${TEST_DIR}/err_out"
+  local stream_a="${TEST_DIR}/stream_a"
+  local stream_b="${TEST_DIR}/stream_b"
+
+  which python3 >/dev/null || return $SKIP_EXIT_CODE
+
+  make_framed_image "$input" "$output" &&
+    make_framed_streams "$input" "$stream_a" "$stream_b" corrupt &&
+    $MEN_FLASH --framed -i "$stream_a" -i "$stream_b" -o "$output" > /dev/null 2> "$err_out"
+  if [ $? = 1 ]; then
+    # we actually want to see a failure here
+    ret=0
+  else
+    ret=1
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Record checksum mismatch" "$err_out" >/dev/null || { echo "Wrong error message" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$err_out"
+    fi
+  fi
+
+  # records with unknown flags are rejected too
+  if [ $ret = 0 ]; then
+    make_framed_streams "$input" "$stream_a" "$stream_b" flags &&
+      $MEN_FLASH --framed -i "$stream_a" -i "$stream_b" -o "$output" > /dev/null 2> "$err_out"
+    [ $? = 1 ] || { echo "Unknown record flags accepted" && ret=1; }
+    grep "Unsupported record flags 0x1" "$err_out" >/dev/null || { echo "Wrong error message for flags" && ret=1; }
+  fi
+
+  # multiple inputs are only valid for framed input
+  if [ $ret = 0 ]; then
+    $MEN_FLASH -i "$stream_a" -i "$stream_b" -o "$output" > /dev/null 2> "$err_out" &&
+      { echo "Multiple inputs accepted without --framed" && ret=1; }
+    grep "Multiple inputs are only supported with --framed" "$err_out" >/dev/null ||
+      { echo "Wrong error message for multiple inputs" && ret=1; }
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$err_out"
+  rm -f "$stream_a"
+  rm -f "$stream_b"
+  return $ret
+}
+
+framed_incomplete_test() {
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local err_out="${TEST_DIR}/err_out"
+  local stream_a="${TEST_DIR}/stream_a"
+  local stream_b="${TEST_DIR}/stream_b"
+
+  which python3 >/dev/null || return $SKIP_EXIT_CODE
+
+  make_framed_image "$input" "$output" &&
+    make_framed_streams "$input" "$stream_a" "$stream_b" incomplete &&
+    $MEN_FLASH --framed -i "$stream_a" -i "$stream_b" -o "$output" > /dev/null 2> "$err_out"
+  if [ $? = 1 ]; then
+    # we actually want to see a failure here
+    ret=0
+  else
+    ret=1
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Image incomplete: $((BLOCK * 6 - BLOCK / 2)) of $((BLOCK * 6)) bytes received" "$err_out" >/dev/null ||
+      { echo "Wrong error message" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$err_out"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$err_out"
+  rm -f "$stream_a"
+  rm -f "$stream_b"
+  return $ret
+}
+
+memory_pressure_test() {
+  local n_bytes=$((BLOCK * 8))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+  local proc="${TEST_DIR}/proc"
+
+  [ -x "$MEN_FLASH_TEST" ] || return $SKIP_EXIT_CODE
+
+  # pretend tasks stall on memory half of the time
+  mkdir -p "$proc/pressure" &&
+    echo "some avg10=50.00 avg60=20.00 avg300=5.00 total=123456" > "$proc/pressure/memory" &&
+    echo "MemAvailable:    8000000 kB" > "$proc/meminfo" &&
+    dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    cat "$input" | MENDER_FLASH_PROC="$proc" $MEN_FLASH_TEST --adapt-memory -s $n_bytes -i - -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "Memory budget low (%): *0\$" "$stats" >/dev/null || { echo "Wrong 'Memory budget low' stats" && ret=1; }
+    local high_water=$(grep "Ring high-water:" "$stats" | tr -s ' ' | cut -d' ' -f3)
+    [ "$high_water" -le $((BLOCK * 2)) ] || { echo "Ring not shrunk under pressure" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  # nothing is adapted unless asked for
+  if [ $ret = 0 ]; then
+    cat "$input" | MENDER_FLASH_PROC="$proc" $MEN_FLASH_TEST -s $n_bytes -i - -o "$output" > "$stats" || ret=1
+    grep "Memory budget low" "$stats" >/dev/null && { echo "Memory adapted without --adapt-memory" && ret=1; }
+  fi
+
+  # no PSI, but little memory available
+  if [ $ret = 0 ]; then
+    rm -f "$proc/pressure/memory"
+    echo "MemAvailable:    4096 kB" > "$proc/meminfo"
+    MENDER_FLASH_PROC="$proc" $MEN_FLASH_TEST --adapt-memory --readahead $((BLOCK * 16)) -i "$input" -o "$output" > "$stats"
+    ret=$?
+  fi
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "Memory budget low (%): *2\$" "$stats" >/dev/null || { echo "Wrong 'Memory budget low' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -rf "$input" "$output" "$stats" "$proc"
+  return $ret
+}
+
+io_throttle_test() {
+  local n_bytes=$((BLOCK * 2))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+  local trace="${TEST_DIR}/test.trace"
+  local proc="${TEST_DIR}/proc"
+
+  [ -x "$MEN_FLASH_TEST" ] || return $SKIP_EXIT_CODE
+
+  # pretend other tasks are stalling on I/O most of the time
+  mkdir -p "$proc/pressure" &&
+    echo "some avg10=80.00 avg60=80.00 avg300=80.00 total=123456" > "$proc/pressure/io" &&
+    dd if=/dev/urandom of="$input" bs=$n_bytes count=2 >/dev/null 2>&1 &&
+    # slow enough for the throttle to measure the rate
+    (dd if="$input" bs=$n_bytes count=1 2>/dev/null; sleep 0.3;
+     dd if="$input" bs=$n_bytes skip=1 count=1 2>/dev/null) |
+      MENDER_FLASH_PROC="$proc" $MEN_FLASH_TEST -v --io-throttle -s $((n_bytes * 2)) -i - -o "$output" > "$stats" 2> "$trace"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "Throttle backoffs: *[1-9][0-9]*\$" "$stats" >/dev/null || { echo "Wrong 'Throttle backoffs' stats" && ret=1; }
+    grep "^io-throttle: pressure 80.0%.* rate 0 -> [0-9]* B/s" "$trace" >/dev/null || { echo "Missing throttle trace" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats" "$trace"
+    fi
+  fi
+
+  # only the 10 s average (as with older kernels), full rewrite
+  if [ $ret = 0 ]; then
+    echo "some avg10=80.00" > "$proc/pressure/io"
+    (dd if="$input" bs=$n_bytes count=1 2>/dev/null; sleep 0.3;
+     dd if="$input" bs=$n_bytes skip=1 count=1 2>/dev/null) |
+      MENDER_FLASH_PROC="$proc" $MEN_FLASH_TEST -w --io-throttle -s $((n_bytes * 2)) -i - -o "$output" > "$stats"
+    ret=$?
+  fi
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "Throttle backoffs: *[1-9][0-9]*\$" "$stats" >/dev/null || { echo "Wrong 'Throttle backoffs' stats with -w" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -rf "$input" "$output" "$stats" "$trace" "$proc"
+  return $ret
+}
+
+verify_sample_test() {
+  local n_bytes=$((BLOCK * 10))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+  local checkpoint="${TEST_DIR}/checkpoint"
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    $MEN_FLASH --verify-sample 0.2 -i "$input" -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "^Verify sample: 2 of 10 blocks (.*)\$" "$stats" >/dev/null || { echo "Wrong 'Verify sample' stats" && ret=1; }
+    grep "^Verify confidence: 95% that fewer than [0-9]* blocks" "$stats" >/dev/null ||
+      { echo "Missing 'Verify confidence' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  # pipe input can't be re-read, the blocks are checked against their CRCs
+  if [ $ret = 0 ]; then
+    cat "$input" | $MEN_FLASH -w --verify-sample 100 -s $n_bytes -i - -o "$output" > "$stats"
+    ret=$?
+  fi
+  if [ $ret = 0 ]; then
+    grep "^Verify sample: 10 of 10 blocks (.*)\$" "$stats" >/dev/null || { echo "Wrong 'Verify sample' stats" && ret=1; }
+    grep "^Verify detection of 1% bad blocks: 100.0%\$" "$stats" >/dev/null ||
+      { echo "Wrong 'Verify detection' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  # pipe input resumed at the very end, there's nothing left to sample
+  if [ $ret = 0 ]; then
+    local state="00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 $n_bytes"
+    local sum=$(printf '%064d' 0)
+    # the first run tells us the checksum the made-up hash state ends with
+    printf 'mender-flash-checkpoint 1\nlength %d\nexpect %s\noffset %d\nsha256 %s\n' \
+      $n_bytes $sum $n_bytes "$state" > "$checkpoint"
+    sum=$(printf '' | $MEN_FLASH --checkpoint "$checkpoint" --expect-sha256 $sum --verify-sample 2 \
+            -s $n_bytes -i - -o "$output" 2>&1 >/dev/null | sed -n 's/^SHA-256 checksum mismatch: //p')
+    printf 'mender-flash-checkpoint 1\nlength %d\nexpect %s\noffset %d\nsha256 %s\n' \
+      $n_bytes $sum $n_bytes "$state" > "$checkpoint"
+    printf '' | $MEN_FLASH --checkpoint "$checkpoint" --expect-sha256 $sum --verify-sample 2 \
+      -s $n_bytes -i - -o "$output" > "$stats"
+    ret=$?
+  fi
+  if [ $ret = 0 ]; then
+    grep "^Verify sample: 0 of 0 blocks (.*)\$" "$stats" >/dev/null || { echo "Wrong 'Verify sample' stats" && ret=1; }
+    grep "^Verify confidence: nothing was written, nothing sampled\$" "$stats" >/dev/null ||
+      { echo "Wrong 'Verify confidence' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input" "$output" "$stats" "$checkpoint"
+  return $ret
+}
+
+pipe_batch_write_test() {
+  local n_bytes=$((BLOCK * 10 + 1000))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+
+  # the output differs from the input in the 4th and 9th block only (one
+  # byte is incremented in each, so they surely differ)
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    cp "$input" "$output" &&
+    dd if="$input" bs=1 skip=$((BLOCK * 3 + 7)) count=1 2>/dev/null | tr '\000-\377' '\001-\377\000' |
+      dd of="$output" bs=1 seek=$((BLOCK * 3 + 7)) conv=notrunc >/dev/null 2>&1 &&
+    dd if="$input" bs=1 skip=$((BLOCK * 8)) count=1 2>/dev/null | tr '\000-\377' '\001-\377\000' |
+      dd of="$output" bs=1 seek=$((BLOCK * 8)) conv=notrunc >/dev/null 2>&1 &&
+    cat "$input" | $MEN_FLASH --batch-size $((BLOCK * 4)) -s $n_bytes -i - -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "^Blocks written: *2\$" "$stats" >/dev/null || { echo "Wrong 'Blocks written' stats" && ret=1; }
+    grep "^Blocks omitted: *9\$" "$stats" >/dev/null || { echo "Wrong 'Blocks omitted' stats" && ret=1; }
+    grep "^Batch size: *$((BLOCK * 4))\$" "$stats" >/dev/null || { echo "Wrong 'Batch size' stats" && ret=1; }
+    # the batched compare doesn't go through the page cache first
+    grep "^Bytes from cache:" "$stats" >/dev/null && { echo "Unexpected 'Bytes from cache' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input" "$output" "$stats"
+  return $ret
+}
+
+engine_select_test() {
+  local n_bytes=$((BLOCK * 3))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local trace="${TEST_DIR}/test.trace"
+
+  # nothing needs to see the data, an in-kernel copy is picked
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    $MEN_FLASH -v -w -i "$input" -o "$output" > /dev/null 2> "$trace"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "^engine: input regular file, target regular file\$" "$trace" >/dev/null ||
+      { echo "Missing probe results" && ret=1; }
+    grep "^engine: \(copy_file_range\|sendfile\) (.*)\$" "$trace" >/dev/null ||
+      { echo "Wrong engine picked" && ret=1; }
+  fi
+
+  # splice() needs a pipe
+  if [ $ret = 0 ]; then
+    $MEN_FLASH --engine splice -w -i "$input" -o "$output" > /dev/null 2> "$trace" &&
+      { echo "Unusable engine accepted" && ret=1; }
+    grep "^Engine 'splice' cannot be used: the input is not a pipe\$" "$trace" >/dev/null ||
+      { echo "Missing explanation" && ret=1; }
+  fi
+
+  if [ $ret = 0 ]; then
+    rm -f "$output"
+    cat "$input" | $MEN_FLASH -v --engine user -w -s $n_bytes -i - -o "$output" > /dev/null 2> "$trace"
+    ret=$?
+  fi
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "^engine: user (forced by --engine)\$" "$trace" >/dev/null || { echo "Wrong engine picked" && ret=1; }
+  fi
+  if [ $ret != 0 ]; then
+    cat "$trace"
+  fi
+
+  rm -f "$input" "$output" "$trace"
+  return $ret
+}
+
+ubi_leb_change_test() {
+  local leb=131072
+  local n_bytes=$((leb * 10 + 1000))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+
+  [ -x "$MEN_FLASH_TEST" ] || return $SKIP_EXIT_CODE
+
+  # LEBs 2 and 9 differ (by an incremented byte), the old image is 3 LEBs longer
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    cp "$input" "$output" &&
+    dd if=/dev/urandom of="$output" bs=$leb count=3 oflag=append conv=notrunc >/dev/null 2>&1 &&
+    dd if="$input" bs=1 skip=$((leb * 2 + 5)) count=1 2>/dev/null | tr '\000-\377' '\001-\377\000' |
+      dd of="$output" bs=1 seek=$((leb * 2 + 5)) conv=notrunc >/dev/null 2>&1 &&
+    dd if="$input" bs=1 skip=$((leb * 9)) count=1 2>/dev/null | tr '\000-\377' '\001-\377\000' |
+      dd of="$output" bs=1 seek=$((leb * 9)) conv=notrunc >/dev/null 2>&1 &&
+    cat "$input" | MENDER_FLASH_UBI_FAKE_LEB_SIZE=$leb $MEN_FLASH_TEST -s $n_bytes -i - -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "^LEBs changed: *2\$" "$stats" >/dev/null || { echo "Wrong 'LEBs changed' stats" && ret=1; }
+    grep "^LEBs unchanged: *9\$" "$stats" >/dev/null || { echo "Wrong 'LEBs unchanged' stats" && ret=1; }
+    grep "^LEBs unmapped: *3\$" "$stats" >/dev/null || { echo "Wrong 'LEBs unmapped' stats" && ret=1; }
+    grep "^Bytes written: *$((leb * 2))\$" "$stats" >/dev/null || { echo "Wrong 'Bytes written' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input" "$output" "$stats"
+  return $ret
+}
+
+discard_test() {
+  local n_bytes=$((BLOCK * 3 + 1000))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+  local trace="${TEST_DIR}/test.trace"
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    dd if=/dev/urandom of="$output" bs=$BLOCK count=4 >/dev/null 2>&1 &&
+    $MEN_FLASH -w --discard -i "$input" -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp -n $n_bytes "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "^Bytes discarded: $n_bytes\$" "$stats" >/dev/null || { echo "Wrong 'Bytes discarded' stats" && ret=1; }
+    grep "^Discard time (ms): [0-9]\+\$" "$stats" >/dev/null || { echo "Missing 'Discard time' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  # comparing with the target needs its contents
+  if [ $ret = 0 ]; then
+    $MEN_FLASH --discard -i "$input" -o "$output" > "$stats" 2> "$trace"
+    ret=$?
+  fi
+  if [ $ret = 0 ]; then
+    grep "^warning: Discarding only applies to full rewrites" "$trace" >/dev/null ||
+      { echo "Missing warning" && ret=1; }
+    grep "^Blocks omitted: *4\$" "$stats" >/dev/null || { echo "Wrong 'Blocks omitted' stats" && ret=1; }
+  fi
+
+  rm -f "$input" "$output" "$stats" "$trace"
+  return $ret
+}
+
+stats_shm_test() {
+  local n_bytes=$((BLOCK * 5 + 1000))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local name="mender-flash-test-$$"
+  local page="/dev/shm/$name"
+
+  [ -d /dev/shm ] || return $SKIP_EXIT_CODE
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    cat "$input" | $MEN_FLASH --stats-shm "$name" -s $n_bytes -i - -o "$output" > /dev/null
+  ret=$?
+
+  # see stats_page.h for the layout
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    [ "$(head -c 7 "$page")" = "MFSTATS" ] || { echo "Wrong magic" && ret=1; }
+    [ $(od -An -t u8 -j 16 -N 8 "$page") -ge 2 ] || { echo "Page never published" && ret=1; }
+    [ $(od -An -t u4 -j 28 -N 4 "$page") = 4 ] || { echo "Wrong phase" && ret=1; }
+    [ $(od -An -t u8 -j 32 -N 8 "$page") = $n_bytes ] || { echo "Wrong total size" && ret=1; }
+    [ $(od -An -t u8 -j 40 -N 8 "$page") = $n_bytes ] || { echo "Wrong total bytes" && ret=1; }
+    [ $(od -An -t u8 -j 56 -N 8 "$page") = 6 ] || { echo "Wrong blocks written" && ret=1; }
+  fi
+
+  # one in-kernel copy without syncing (-f 0) is still published in 8 MiB
+  # chunks, everything counts as written with -w
+  if [ $ret = 0 ]; then
+    n_bytes=$((BLOCK * 64))
+    dd if=/dev/urandom of="$input" bs=$BLOCK count=64 >/dev/null 2>&1 &&
+      $MEN_FLASH -w --fsync-interval 0 --stats-shm "$name" -i "$input" -o "$output" > /dev/null
+    ret=$?
+  fi
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    [ $(od -An -t u8 -j 16 -N 8 "$page") -ge $((2 * (8 + 2))) ] || { echo "Copy not published in chunks" && ret=1; }
+    [ $(od -An -t u8 -j 48 -N 8 "$page") = $n_bytes ] || { echo "Wrong bytes written with -w" && ret=1; }
+  fi
+
+  rm -f "$input" "$output" "$page"
+  return $ret
+}
+
+stats_memfd_test() {
+  local n_bytes=$((BLOCK * 3))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+
+  which python3 >/dev/null || return $SKIP_EXIT_CODE
+  python3 -c 'import os; os.memfd_create' 2>/dev/null || return $SKIP_EXIT_CODE
+
+  # the page lives in a memfd inherited from the parent
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    python3 - "$MEN_FLASH" "$input" "$output" $n_bytes <<'PYEOF'
+import os, struct, subprocess, sys
+men_flash, image, target, n_bytes = sys.argv[1], sys.argv[2], sys.argv[3], int(sys.argv[4])
+fd = os.memfd_create("mender-flash-stats")
+subprocess.run([men_flash, "--stats-shm", "fd:%d" % fd, "-i", image, "-o", target],
+               pass_fds=[fd], stdout=subprocess.DEVNULL, check=True)
+page = os.pread(fd, 112, 0)
+if page[:7] != b"MFSTATS":
+    sys.exit("Wrong magic")
+phase, = struct.unpack_from("<I", page, 28)
+total_bytes, = struct.unpack_from("<Q", page, 40)
+if (phase != 4) or (total_bytes != n_bytes):
+    sys.exit("Wrong phase %d or total bytes %d" % (phase, total_bytes))
+PYEOF
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+  fi
+
+  rm -f "$input" "$output"
+  return $ret
+}
+
+index_write_test() {
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local index="${TEST_DIR}/test.idx"
+  local stats="${TEST_DIR}/test.stats"
+
+  # data, zeros, data, short tail
+  dd if=/dev/urandom of="$input" bs=$BLOCK count=2 >/dev/null 2>&1 &&
+    dd if=/dev/zero bs=$BLOCK count=2 >> "$input" 2>/dev/null &&
+    dd if=/dev/urandom bs=$BLOCK count=1 >> "$input" 2>/dev/null &&
+    dd if=/dev/urandom bs=1000 count=1 >> "$input" 2>/dev/null &&
+    $MEN_FLASH_INDEX -j 3 -i "$input" -o "$index" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    grep "^Blocks: 6\$" "$stats" >/dev/null || { echo "Wrong 'Blocks' in index" && ret=1; }
+    grep "^Fill blocks: 2 (2 zero)\$" "$stats" >/dev/null || { echo "Wrong 'Fill blocks' in index" && ret=1; }
+    grep "^Extents: 2\$" "$stats" >/dev/null || { echo "Wrong 'Extents' in index" && ret=1; }
+    if which sha256sum >/dev/null; then
+      grep "^SHA-256: $(sha256sum "$input" | cut -d' ' -f1)\$" "$stats" >/dev/null ||
+        { echo "Wrong fingerprint in index" && ret=1; }
+    fi
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  if [ $ret = 0 ]; then
+    $MEN_FLASH --index "$index" -i "$input" -o "$output" > "$stats"
+    ret=$?
+  fi
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "Blocks verified: *6\$" "$stats" >/dev/null || { echo "Wrong 'Blocks verified' stats" && ret=1; }
+    grep "Blocks pre-planned: *0\$" "$stats" >/dev/null || { echo "Wrong 'Blocks pre-planned' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  # change one block on the target, the rest is known to be there up front
+  if [ $ret = 0 ]; then
+    printf 'X' | dd of="$output" bs=1 seek=$((BLOCK * 4 + 10)) conv=notrunc >/dev/null 2>&1 &&
+      $MEN_FLASH --index "$index" -i "$input" -o "$output" > "$stats"
+    ret=$?
+  fi
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "Blocks written: *1\$" "$stats" >/dev/null || { echo "Wrong 'Blocks written' stats" && ret=1; }
+    grep "Blocks pre-planned: *5\$" "$stats" >/dev/null || { echo "Wrong 'Blocks pre-planned' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input" "$output" "$index" "$stats"
+  return $ret
+}
+
+pipe_index_test() {
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local index="${TEST_DIR}/test.idx"
+  local stats="${TEST_DIR}/test.stats"
+
+  # no --input-size needed, the index knows it
+  dd if=/dev/urandom of="$input" bs=$BLOCK count=3 >/dev/null 2>&1 &&
+    cat "$input" | $MEN_FLASH_INDEX -i - -o "$index" > /dev/null &&
+    cat "$input" | $MEN_FLASH --index "$index" -i - -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    grep "Blocks verified: *3\$" "$stats" >/dev/null || { echo "Wrong 'Blocks verified' stats" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+    fi
+  fi
+
+  rm -f "$input" "$output" "$index" "$stats"
+  return $ret
+}
+
+index_mismatch_test() {
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local index="${TEST_DIR}/test.idx"
+  local err_out="${TEST_DIR}/err_out"
+
+  dd if=/dev/urandom of="$input" bs=$BLOCK count=3 >/dev/null 2>&1 &&
+    $MEN_FLASH_INDEX -i "$input" -o "$index" > /dev/null &&
+    printf 'X' | dd of="$input" bs=1 seek=$((BLOCK * 2 + 10)) conv=notrunc >/dev/null 2>&1 &&
+    $MEN_FLASH --index "$index" -i "$input" -o "$output" > /dev/null 2> "$err_out"
+  if [ $? = 1 ]; then
+    # we actually want to see a failure here
+    ret=0
+  else
+    ret=1
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Input does not match the index at offset $((BLOCK * 2))" "$err_out" >/dev/null ||
+      { echo "Wrong error message" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$err_out"
+    fi
+  fi
+
+  rm -f "$input" "$output" "$index" "$err_out"
+  return $ret
+}
+
+perf_counters_test() {
+  local n_bytes=$((BLOCK * 2))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+  local errors="${TEST_DIR}/test.err"
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    $MEN_FLASH --perf-counters -i "$input" -o "$output" > "$stats" 2> "$errors"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    cmp "$input" "$output" || { echo "Output differs from input" && ret=1; }
+    # counters may be unavailable (e.g. perf_event_paranoid), flashing must go on
+    if grep "Performance counters not available" "$errors" >/dev/null; then
+      grep "Perf counters per GiB" "$stats" >/dev/null && { echo "Unexpected counter table" && ret=1; }
+    else
+      grep "^Perf counters per GiB: .*cycles .*context-switches\$" "$stats" >/dev/null ||
+        { echo "Missing counter table" && ret=1; }
+      for phase in input compare write sync other total; do
+        grep "^  $phase " "$stats" >/dev/null || { echo "Missing '$phase' counters" && ret=1; }
+      done
+    fi
+    if [ $ret != 0 ]; then
+      cat "$stats" "$errors"
+    fi
+  fi
+
+  rm -f "$input" "$output" "$stats" "$errors"
+  return $ret
+}
+
+history_test() {
+  local n_bytes=$((BLOCK * 2))
+  local input="${TEST_DIR}/test.img"
+  local output="${TEST_DIR}/test.out"
+  local stats="${TEST_DIR}/test.stats"
+  local history="${TEST_DIR}/history"
+
+  dd if=/dev/urandom of="$input" bs=$n_bytes count=1 >/dev/null 2>&1 &&
+    $MEN_FLASH --history "$history" -i "$input" -o "$output" > "$stats"
+  ret=$?
+
+  if [ $ret = 0 ]; then
+    grep "Engine: compare\$" "$stats" >/dev/null || { echo "Wrong 'Engine' stats" && ret=1; }
+    grep "Baseline runs: 0\$" "$stats" >/dev/null || { echo "Wrong 'Baseline runs' stats" && ret=1; }
+    grep "Performance: no baseline yet\$" "$stats" >/dev/null || { echo "Wrong 'Performance' stats" && ret=1; }
+    [ $(wc -l < "$history") = 1 ] || { echo "Wrong number of history entries" && ret=1; }
+    grep "^1 [0-9]\+ $output compare $n_bytes " "$history" >/dev/null || { echo "Wrong history entry" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+      cat "$history"
+    fi
+  fi
+
+  # pretend the target used to be much faster
+  for i in 1 2 3; do
+    echo "1 0 $output compare $n_bytes 0 1000 1000000000000000 0 0 0" >> "$history"
+  done
+  if [ $ret = 0 ]; then
+    $MEN_FLASH --history "$history" -i "$input" -o "$output" > "$stats" 2>/dev/null
+    ret=$?
+  fi
+
+  if [ $ret = 0 ]; then
+    grep "Baseline runs: 4\$" "$stats" >/dev/null || { echo "Wrong 'Baseline runs' stats" && ret=1; }
+    grep "Performance: REGRESSION\$" "$stats" >/dev/null || { echo "Wrong 'Performance' stats" && ret=1; }
+    [ $(wc -l < "$history") = 5 ] || { echo "Wrong number of history entries" && ret=1; }
+    if [ $ret != 0 ]; then
+      cat "$stats"
+      cat "$history"
+    fi
+  fi
+
+  rm -f "$input"
+  rm -f "$output"
+  rm -f "$stats"
+  rm -f "$history"
+  return $ret
+}
+
 basic_write_with_no_block_multiple_test() {
   local n_bytes=$((2 * BLOCK + 3))
   local input="${TEST_DIR}/test.img"
@@ -918,6 +2164,8 @@ run_test basic_write_with_size_test
 run_test basic_write_with_no_sync_test
 run_test basic_write_with_short_size_test
 run_test double_write_with_defaults_test
+run_test cached_compare_test
+run_test readahead_write_test
 run_test partial_match_with_defaults_test
 run_test double_write_everything_test
 run_test double_write_everything_with_no_sync_test
@@ -930,18 +2178,49 @@ run_test pipe_double_write_with_defaults_test
 run_test pipe_partial_match_with_defaults_test
 run_test pipe_double_write_everything_test
 run_test pipe_partial_match_write_everything_test
+run_test pipe_ring_write_test
+run_test pipe_no_ring_write_test
+run_test pipe_ring_stop_test
 
 run_test no_input_test
 run_test bad_input_test
 run_test err_input_test
 run_test bad_output_test
 run_test bad_sync_interval_test
+run_test late_sync_interval_test
 run_test bad_size_test
 run_test pipe_write_no_size_test
 run_test pipe_fail_test
 
 run_test partial_match_in_the_middle_test
 run_test partial_match_in_the_middle_block_overlap_test
+run_test wear_stats_test
+run_test expect_sha256_test
+run_test pipe_expect_sha256_write_everything_test
+run_test pipe_hashed_splice_sync_test
+run_test expect_sha256_mismatch_test
+run_test pipe_checkpoint_resume_test
+run_test checkpoint_resume_test
+run_test checkpoint_mismatch_test
+
+run_test framed_write_test
+run_test framed_corrupt_test
+run_test framed_incomplete_test
+
+run_test history_test
+run_test perf_counters_test
+run_test index_write_test
+run_test pipe_index_test
+run_test index_mismatch_test
+run_test memory_pressure_test
+run_test io_throttle_test
+run_test verify_sample_test
+run_test pipe_batch_write_test
+run_test engine_select_test
+run_test ubi_leb_change_test
+run_test discard_test
+run_test stats_shm_test
+run_test stats_memfd_test
 
 run_test basic_write_with_no_block_multiple_test
 run_test basic_write_shorter_than_block_test